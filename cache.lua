@@ -0,0 +1,260 @@
+----------------------------------------------------------------------
+-- description:
+--     mattorch.cache - on-disk cache of converted tensors.
+--
+--     Each cached .mat file is stored as an index (<key>.t7), which
+--     holds the loaded variables with every tensor replaced by a
+--     descriptor, plus one raw, native-layout file per tensor
+--     (<key>.<nonce>.<n>.bin). On a hit, these raw files are mapped back
+--     into storages (private mappings: writes to the returned
+--     tensors never reach the cache), so no decompression or copy
+--     happens.
+--
+--     Entries are keyed by absolute path, size and mtime (to the
+--     nanosecond); the content hash of the .mat file is recorded in
+--     the index, and checked on every hit unless verify=false. A
+--     manifest tracks the size of every entry; hits only touch the
+--     index, whose mtime records the last use, and least recently
+--     used entries are evicted once the cache grows over its size
+--     cap. The manifest is only updated on a miss, under a lock file,
+--     so processes can share a cache directory.
+----------------------------------------------------------------------
+
+require 'torch'
+require 'paths'
+require 'libmattorch'
+
+local cache = {}
+
+-- default size cap: 4GB
+cache.defaultSize = 4 * 1024^3
+
+local MANIFEST = 'manifest.t7'
+local LOCK = 'lock'
+
+-- raw readers/writers, per tensor type
+local kinds = {
+   ['torch.DoubleTensor'] = 'Double',
+   ['torch.FloatTensor']  = 'Float',
+   ['torch.LongTensor']   = 'Long',
+   ['torch.IntTensor']    = 'Int',
+   ['torch.ShortTensor']  = 'Short',
+   ['torch.CharTensor']   = 'Char',
+   ['torch.ByteTensor']   = 'Byte',
+}
+
+local function abspath(path)
+   if path:sub(1,1) == '/' then return path end
+   return paths.concat(paths.cwd(), path)
+end
+
+-- unique per store, even across processes sharing a pid (containers)
+local counter = 0
+local function nonce()
+   counter = counter + 1
+   local f = io.open('/dev/urandom', 'rb')
+   local bytes = f and f:read(8)
+   if f then f:close() end
+   return libmattorch.hash(table.concat({libmattorch.getpid(), os.time(), os.clock(),
+                                         counter, tostring({}), bytes or ''}, ':'))
+end
+
+local function loadManifest(dir)
+   local file = paths.concat(dir, MANIFEST)
+   if paths.filep(file) then
+      local ok, manifest = pcall(torch.load, file)
+      if ok and type(manifest) == 'table' then return manifest end
+   end
+   return {entries = {}}
+end
+
+local function saveManifest(dir, manifest)
+   local file = paths.concat(dir, MANIFEST)
+   local tmp = file .. '.' .. nonce() .. '.tmp'
+   torch.save(tmp, manifest)
+   os.rename(tmp, file)
+end
+
+-- run f(...) holding the lock of the cache in dir
+local function locked(dir, f, ...)
+   local lock = libmattorch.lock(paths.concat(dir, LOCK))
+   local res = {pcall(f, ...)}
+   libmattorch.unlock(lock)
+   if not res[1] then error(res[2], 0) end
+   return unpack(res, 2)
+end
+
+-- remove all the files of an entry
+local function removeEntry(dir, manifest, key)
+   local entry = manifest.entries[key]
+   if entry then
+      for _,file in ipairs(entry.files) do
+         os.remove(paths.concat(dir, file))
+      end
+      manifest.entries[key] = nil
+   end
+   os.remove(paths.concat(dir, key .. '.t7'))
+end
+
+-- replace tensors by descriptors, writing their content to raw files
+local function store(dir, key, value, state)
+   local kind = kinds[torch.typename(value) or '']
+   if kind then
+      local desc = {__mattorch_cached = true,
+                    type = torch.typename(value),
+                    size = value:size():totable()}
+      if value:nElement() > 0 then
+         -- unique names: neither concurrent misses nor a later store
+         -- of the same key ever write (or remove) these files
+         desc.file = key .. '.' .. state.nonce .. '.' .. (#state.files+1) .. '.bin'
+         table.insert(state.files, desc.file)
+         local tensor = value:contiguous()
+         local storage = tensor:storage()
+         if tensor:storageOffset() ~= 1 or storage:size() ~= tensor:nElement() then
+            storage = tensor:clone():storage()
+         end
+         local f = torch.DiskFile(paths.concat(dir, desc.file), 'w'):binary()
+         f['write' .. kind](f, storage)
+         f:close()
+         state.bytes = state.bytes + tensor:nElement() * tensor:elementSize()
+      end
+      return desc
+   elseif type(value) == 'table' then
+      local t = {}
+      for k,v in pairs(value) do
+         t[k] = store(dir, key, v, state)
+      end
+      return t
+   end
+   return value
+end
+
+-- replace descriptors by tensors mapped on their raw files
+local function restore(dir, value)
+   if type(value) ~= 'table' then
+      return value
+   elseif value.__mattorch_cached then
+      local size = torch.LongStorage(value.size)
+      if not value.file then
+         local tensor = torch[value.type:gsub('^torch%.', '')]()
+         if #value.size > 0 then tensor:resize(size) end
+         return tensor
+      end
+      local storageType = value.type:gsub('^torch%.', ''):gsub('Tensor$', 'Storage')
+      local storage = torch[storageType](paths.concat(dir, value.file), false)
+      return torch[value.type:gsub('^torch%.', '')](storage, 1, size)
+   end
+   local t = {}
+   for k,v in pairs(value) do
+      t[k] = restore(dir, v)
+   end
+   return t
+end
+
+-- last use of an entry: mtime of its index, touched on every hit
+local function lastUsed(dir, key)
+   local _, mtime, mtimensec = libmattorch.fileinfo(paths.concat(dir, key .. '.t7'))
+   return mtime and mtime + mtimensec * 1e-9 or 0
+end
+
+-- evict least recently used entries until the cache fits in maxSize
+local function evict(dir, manifest, maxSize, keep)
+   local total = 0
+   for _,entry in pairs(manifest.entries) do
+      total = total + entry.bytes
+   end
+   if total <= maxSize then return end
+   local used = {}
+   for key in pairs(manifest.entries) do
+      used[key] = lastUsed(dir, key)
+   end
+   while total > maxSize do
+      local oldest, oldestKey
+      for key,entry in pairs(manifest.entries) do
+         if key ~= keep and (not oldest or used[key] < used[oldestKey]) then
+            oldest, oldestKey = entry, key
+         end
+      end
+      if not oldestKey then break end
+      total = total - oldest.bytes
+      removeEntry(dir, manifest, oldestKey)
+   end
+end
+
+-- load a .mat file through the cache in dir
+-- loader(path) is called on a miss, and must return the loaded variables;
+-- opts.tag distinguishes entries of the same file loaded with different
+-- conversions
+function cache.load(path, dir, loader, opts)
+   opts = opts or {}
+   local maxSize = opts.cacheSize or cache.defaultSize
+   local size, mtime, mtimensec = libmattorch.fileinfo(path)
+   if not size then
+      error('<mattorch.load> cannot stat file ' .. path)
+   end
+   if not paths.dirp(dir) then
+      paths.mkdir(dir)
+   end
+   path = abspath(path)
+   local key = libmattorch.hash(table.concat({path, size, mtime, mtimensec, opts.tag or ''}, ':'))
+   local index = paths.concat(dir, key .. '.t7')
+   local unchanged = function(entry)
+      return entry.size == size and entry.mtime == mtime and entry.mtimensec == mtimensec
+   end
+
+   -- hit ? no lock, and no manifest update: the entry can be evicted
+   -- by another process at any time, so any failure to load or map
+   -- it falls back to a miss; its use is recorded by touching the index
+   if paths.filep(index) then
+      local ok, cached = pcall(torch.load, index)
+      if ok and type(cached) == 'table'
+         and (opts.verify == false or cached.hash == libmattorch.hashFile(path)) then
+         local ok, vars = pcall(restore, dir, cached.vars)
+         if ok then
+            libmattorch.touch(index)
+            return vars
+         end
+      end
+   end
+
+   -- miss: load and store, under unique file names
+   local vars = loader(path)
+   local state = {files = {}, bytes = 0, nonce = nonce()}
+   local cached = {hash = libmattorch.hashFile(path), size = size,
+                   mtime = mtime, mtimensec = mtimensec,
+                   vars = store(dir, key, vars, state)}
+   local tmp = index .. '.' .. state.nonce .. '.tmp'
+   torch.save(tmp, cached)
+
+   -- publish: invalidate entries of older versions of this file,
+   -- replace any entry stored meanwhile, and evict
+   locked(dir, function()
+      local manifest = loadManifest(dir)
+      for k,entry in pairs(manifest.entries) do
+         if entry.path == path and not unchanged(entry) then
+            removeEntry(dir, manifest, k)
+         end
+      end
+      removeEntry(dir, manifest, key)
+      os.rename(tmp, index)
+      manifest.entries[key] = {path = path, size = size, mtime = mtime, mtimensec = mtimensec,
+                               bytes = state.bytes, files = state.files}
+      evict(dir, manifest, maxSize, key)
+      saveManifest(dir, manifest)
+   end)
+   return vars
+end
+
+-- drop every entry of the cache in dir
+function cache.clear(dir)
+   if not paths.dirp(dir) then return end
+   locked(dir, function()
+      local manifest = loadManifest(dir)
+      for key in pairs(manifest.entries) do
+         removeEntry(dir, manifest, key)
+      end
+      saveManifest(dir, manifest)
+   end)
+end
+
+return cache
@@ -34,6 +34,8 @@ require 'xlua'
 require 'torch'
 require 'libmattorch'
 
+local cache = require 'mattorch.cache'
+
 ------------------------------------------------------------
 -- helps
 --
@@ -42,7 +44,50 @@ local help = {
 load = [[Loads a .mat file into a Lua table. 
 Each mex Array is converted into a torch.Tensor.
 A table with all the loaded variables is returned:
-  {varname1 = var1, varname2 = var2, ... } ]]
+  {varname1 = var1, varname2 = var2, ... }
+Options can be given as a second argument:
+  > vars = mattorch.load('input.mat', {cache = '/tmp/matcache'})
+  cache     : directory where converted tensors are cached; later
+              loads of the same (unmodified) file map the cached
+              tensors, instead of decoding the .mat file again
+  cacheSize : size cap of the cache, in bytes (default 4GB); least
+              recently used files are evicted first
+  verify    : check the content hash of the file on every cache hit
+              (default true); false trusts path, size and mtime
+  dtype     : type of all loaded tensors ('double', 'float', 'long',
+              'int', 'short', 'char' or 'byte'); data is converted
+              while copied out of the file, so no full-precision
+              tensor is ever allocated
+  dtypes    : per-variable dtype, overrides dtype:
+              > mattorch.load('input.mat', {dtype='float', dtypes={labels='byte'}}) ]]
+,
+loadInto = [[Loads a .mat file into existing tensors.
+Variables named in the given table are decoded directly into the
+given tensors, converted to their type; a tensor is only resized
+if its shape differs from the variable's. Other variables are
+loaded as with mattorch.load. Reloading same-shaped files then
+allocates no new tensors:
+  > vars = mattorch.loadInto('input.mat', {X = X, y = y})
+  > -- vars.X == X, vars.y == y
+Targets must be contiguous CPU tensors, and every target must
+be found in the file, otherwise an error is raised. A target that
+is a view of a larger storage (e.g. from narrow) must already have
+the variable's shape.
+Options (dtype, dtypes) can be given as a third argument, and
+apply to the variables without a target tensor. ]]
+,
+loadMany = [[Loads many .mat files, on a pool of worker threads.
+Files are read from disk in parallel; libmat is not thread-safe,
+so decoding them (from memory) is serialized, and the conversions
+into tensors run in parallel again. The loaded variables are pushed into Lua on the calling thread.
+  > all = mattorch.loadMany({'a.mat', 'b.mat', ...}, {threads = 8})
+  > -- all[1] = {varname1 = var1, ... }, all[2] = ...
+  > -- OR, as soon as each file is decoded:
+  > mattorch.loadMany(paths, {callback = function(vars, path, index) ... end})
+  threads  : number of worker threads (default 4)
+  inflight : max number of decoded files not yet consumed by Lua,
+             this bounds memory usage (default 2*threads)
+  dtype, dtypes : type conversion, as in mattorch.load ]]
 ,
 save = [[Exports variables to a .mat file.
 Supported now:
@@ -61,13 +106,58 @@ Supported now:
 mattorch = {}
 
 -- load
-mattorch.load = function(path)
+mattorch.load = function(path,opts)
                  if not path then
                     xlua.error('please provide a path','mattorch.load',help.load)
                  end
-                 return libmattorch.load(path)
+                 opts = opts or {}
+                 local loader = function(path)
+                                   return libmattorch.load(path, opts.dtype, opts.dtypes)
+                                end
+                 if opts.cache then
+                    -- converted tensors depend on the dtypes
+                    local tag = {}
+                    for name,dtype in pairs(opts.dtypes or {}) do
+                       table.insert(tag, name .. '=' .. dtype)
+                    end
+                    table.sort(tag)
+                    table.insert(tag, 1, opts.dtype or 'native')
+                    return cache.load(path, opts.cache, loader, {cacheSize = opts.cacheSize,
+                                                                 verify = opts.verify,
+                                                                 tag = table.concat(tag, ',')})
+                 end
+                 return loader(path)
               end
 
+-- load into existing tensors
+mattorch.loadInto = function(path,targets,opts)
+                     if not path or type(targets) ~= 'table' then
+                        xlua.error('please provide a path and a table of tensors','mattorch.loadInto',help.loadInto)
+                     end
+                     opts = opts or {}
+                     return libmattorch.loadInto(path, targets, opts.dtype, opts.dtypes)
+                  end
+
+-- load many files, concurrently
+mattorch.loadMany = function(paths,opts)
+                     if type(paths) ~= 'table' then
+                        xlua.error('please provide a list of paths','mattorch.loadMany',help.loadMany)
+                     end
+                     opts = opts or {}
+                     local threads = opts.threads or 4
+                     local inflight = opts.inflight or 2*threads
+                     return libmattorch.loadMany(paths, threads, inflight, opts.callback,
+                                                 opts.dtype, opts.dtypes)
+                  end
+
+-- clear cache
+mattorch.clearCache = function(dir)
+                         if not dir then
+                            xlua.error('please provide a cache directory','mattorch.clearCache')
+                         end
+                         cache.clear(dir)
+                      end
+
 -- save
 mattorch.save = function(path,vars)
                  if not path or not vars then
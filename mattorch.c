@@ -50,12 +50,62 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
-static void readAndPushMxArray(lua_State *L, const mxArray* src);
-static void pushMxCellData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims);
-static void pushMxStructData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims);
+// Target types of a load: DTYPE_NATIVE keeps the tensor type that
+// matches the Matlab class, others convert while copying.
+typedef enum {
+  DTYPE_NATIVE = 0,
+  DTYPE_DOUBLE,
+  DTYPE_FLOAT,
+  DTYPE_LONG,
+  DTYPE_INT,
+  DTYPE_SHORT,
+  DTYPE_CHAR,
+  DTYPE_BYTE
+} mtDtype;
 
-void pushMxStructData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims)
+static const char *dtypeNames[] = {
+  "native", "double", "float", "long", "int", "short", "char", "byte", NULL
+};
+
+static mtDtype checkDtype(lua_State *L, const char *name)
+{
+  int i;
+  for (i=0; dtypeNames[i]; i++)
+    if (strcmp(name, dtypeNames[i]) == 0) return (mtDtype)i;
+  luaL_error(L, "unknown dtype: %s", name);
+  return DTYPE_NATIVE;
+}
+
+// tensor type that holds a Matlab class without conversion
+static mtDtype nativeDtype(mxClassID classid)
+{
+  switch (classid) {
+    case mxDOUBLE_CLASS: return DTYPE_DOUBLE;
+    case mxSINGLE_CLASS: return DTYPE_FLOAT;
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS: return DTYPE_INT;
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS: return DTYPE_SHORT;
+    case mxINT8_CLASS: return DTYPE_CHAR;
+    case mxUINT8_CLASS:
+    case mxLOGICAL_CLASS: return DTYPE_BYTE;
+    default: return DTYPE_NATIVE;
+  }
+}
+
+static void readAndPushMxArray(lua_State *L, const mxArray* src, mtDtype dtype);
+static void pushMxCellData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims, mtDtype dtype);
+static void pushMxStructData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims, mtDtype dtype);
+
+void pushMxStructData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims, mtDtype dtype)
 {
     mwSize numElements = mxGetNumberOfElements(src);
     mwIndex index;
@@ -77,7 +127,7 @@ void pushMxStructData(lua_State *L, const mxArray* src, mwSize ndims, const mwSi
             if(field_array_ptr == NULL)
                 lua_pushstring(L, "NULL");
             else
-                readAndPushMxArray(L, field_array_ptr);
+                readAndPushMxArray(L, field_array_ptr, dtype);
         }else{
             lua_newtable(L);
             lua_pushstring(L, "Length");
@@ -90,7 +140,7 @@ void pushMxStructData(lua_State *L, const mxArray* src, mwSize ndims, const mwSi
                 if(field_array_ptr == NULL)
                     lua_pushstring(L, "NULL");
                 else
-                readAndPushMxArray(L, field_array_ptr);
+                readAndPushMxArray(L, field_array_ptr, dtype);
                 lua_settable(L, -3);
             }
         }        
@@ -98,7 +148,7 @@ void pushMxStructData(lua_State *L, const mxArray* src, mwSize ndims, const mwSi
     }
 }
 
-void pushMxCellData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims)
+void pushMxCellData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize *dims, mtDtype dtype)
 {
     mwIndex index;
     mwSize numElements = mxGetNumberOfElements(src);
@@ -117,16 +167,97 @@ void pushMxCellData(lua_State *L, const mxArray* src, mwSize ndims, const mwSize
         if(element == NULL)
             lua_pushstring(L, "NULL");
         else
-            readAndPushMxArray(L, element);
+            readAndPushMxArray(L, element, dtype);
         lua_settable(L, -3);
     }    
 }
 
 
-void readAndPushMxArray(lua_State *L, const mxArray* src){
-     // get dimensions
+// Conversion kernels: one flat loop per (source, target) pair,
+// simple enough for the compiler to vectorize.
+#define CONVERT_LOOP(TYPE_DST, TYPE_SRC)                        \
+  {                                                             \
+    TYPE_DST *d = (TYPE_DST *)dst;                              \
+    const TYPE_SRC *s = (const TYPE_SRC *)src;                  \
+    for (i=0; i<n; i++) d[i] = (TYPE_DST)s[i];                  \
+  }
+
+#define DEFINE_CONVERT_FROM(NAME, TYPE_SRC)                                     \
+  static void convertFrom##NAME(void *dst, mtDtype to, const void *src, long n) \
+  {                                                                             \
+    long i;                                                                     \
+    switch (to) {                                                               \
+      case DTYPE_DOUBLE: CONVERT_LOOP(double, TYPE_SRC); break;                 \
+      case DTYPE_FLOAT: CONVERT_LOOP(float, TYPE_SRC); break;                   \
+      case DTYPE_LONG: CONVERT_LOOP(long, TYPE_SRC); break;                     \
+      case DTYPE_INT: CONVERT_LOOP(int, TYPE_SRC); break;                       \
+      case DTYPE_SHORT: CONVERT_LOOP(short, TYPE_SRC); break;                   \
+      case DTYPE_CHAR: CONVERT_LOOP(char, TYPE_SRC); break;                     \
+      case DTYPE_BYTE: CONVERT_LOOP(unsigned char, TYPE_SRC); break;            \
+      default: break;                                                           \
+    }                                                                           \
+  }
+
+DEFINE_CONVERT_FROM(Double, double)
+DEFINE_CONVERT_FROM(Single, float)
+DEFINE_CONVERT_FROM(Int32, int32_t)
+DEFINE_CONVERT_FROM(UInt32, uint32_t)
+DEFINE_CONVERT_FROM(Int16, int16_t)
+DEFINE_CONVERT_FROM(UInt16, uint16_t)
+DEFINE_CONVERT_FROM(Int8, int8_t)
+DEFINE_CONVERT_FROM(UInt8, uint8_t)
+
+static void convertData(void *dst, mtDtype to, const mxArray *src, long n)
+{
+  const void *data = mxGetData(src);
+  switch (mxGetClassID(src)) {
+    case mxDOUBLE_CLASS: convertFromDouble(dst, to, data, n); break;
+    case mxSINGLE_CLASS: convertFromSingle(dst, to, data, n); break;
+    case mxINT32_CLASS: convertFromInt32(dst, to, data, n); break;
+    case mxUINT32_CLASS: convertFromUInt32(dst, to, data, n); break;
+    case mxINT16_CLASS: convertFromInt16(dst, to, data, n); break;
+    case mxUINT16_CLASS: convertFromUInt16(dst, to, data, n); break;
+    case mxINT8_CLASS: convertFromInt8(dst, to, data, n); break;
+    case mxUINT8_CLASS:
+    case mxLOGICAL_CLASS: convertFromUInt8(dst, to, data, n); break;
+    default: break;
+  }
+}
+
+// true if a tensor already has the given size and stride
+static int hasSizeAndStride(int ndims, const long *tsize, const long *tstride,
+                            THLongStorage *size, THLongStorage *stride)
+{
+  int k;
+  if (ndims != size->size) return 0;
+  for (k=0; k<ndims; k++)
+    if (tsize[k] != size->data[k] || tstride[k] != stride->data[k]) return 0;
+  return 1;
+}
+
+#define PREPARE_TENSOR(DT, Real, real)                                        \
+    if (dtype == DT) {                                                        \
+      TH##Real##Tensor *t = (TH##Real##Tensor *)tensor;                       \
+      if (!hasSizeAndStride(t->nDimension, t->size, t->stride, size, stride)) \
+        TH##Real##Tensor_resize(t, size, stride);                             \
+      data = TH##Real##Tensor_data(t);                                        \
+      n = TH##Real##Tensor_nElement(t);                                       \
+      elemsize = sizeof(real);                                                \
+    }
+
+// Decodes a numeric (or logical) mxArray into an existing tensor of
+// the given dtype, converting if needed. The tensor keeps its storage,
+// and is only resized if its shape differs from the array's.
+// This does not touch any Lua state, so it can run on worker threads.
+static void copyMxArrayInto(void *tensor, mtDtype dtype, const mxArray* src)
+{
+    // get dimensions
     mwSize ndims = mxGetNumberOfDimensions(src);
     const mwSize *dims = mxGetDimensions(src);
+    mtDtype native = nativeDtype(mxGetClassID(src));
+    void *data = NULL;
+    size_t elemsize = 0;
+    long n = 0;
 
     // infer size and stride
     int k;
@@ -139,87 +270,207 @@ void readAndPushMxArray(lua_State *L, const mxArray* src){
       else
         THLongStorage_set(stride, ndims-k-1, 1);
     }
-     // depending on type, create equivalent Lua/torch data structure
-    if (mxGetClassID(src) == mxDOUBLE_CLASS) {
-      THDoubleTensor *tensor = THDoubleTensor_newWithSize(size, stride);
-      memcpy((void *)(THDoubleTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THDoubleTensor_nElement(tensor) * sizeof(double));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.DoubleTensor"));   
-
-    } else if (mxGetClassID(src) == mxSINGLE_CLASS) {
-      THFloatTensor *tensor = THFloatTensor_newWithSize(size, stride);
-      memcpy((void *)(THFloatTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THFloatTensor_nElement(tensor) * sizeof(float));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.FloatTensor"));
-
-    } else if (mxGetClassID(src) == mxINT32_CLASS) {
-      THIntTensor *tensor = THIntTensor_newWithSize(size, stride);
-      memcpy((void *)(THIntTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THIntTensor_nElement(tensor) * sizeof(int));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.IntTensor"));
-
-    } else if (mxGetClassID(src) == mxUINT32_CLASS) {
-      THIntTensor *tensor = THIntTensor_newWithSize(size, stride);
-      memcpy((void *)(THIntTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THIntTensor_nElement(tensor) * sizeof(int));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.IntTensor"));
-    } else if ((mxGetClassID(src) == mxINT16_CLASS)) {
-      THShortTensor *tensor = THShortTensor_newWithSize(size, stride);
-      memcpy((void *)(THShortTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THShortTensor_nElement(tensor) * sizeof(short));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.ShortTensor"));
-
-    } else if ((mxGetClassID(src) == mxUINT16_CLASS)) {
-      THShortTensor *tensor = THShortTensor_newWithSize(size, stride);
-      memcpy((void *)(THShortTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THShortTensor_nElement(tensor) * sizeof(short));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.ShortTensor"));
-    } else if (mxGetClassID(src) == mxINT8_CLASS) {
-      THCharTensor *tensor = THCharTensor_newWithSize(size, stride);
-      memcpy((void *)(THCharTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THCharTensor_nElement(tensor) * sizeof(char));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.CharTensor"));
-	} else if (mxGetClassID(src) == mxCHAR_CLASS) {
+
+    // shape the tensor
+    PREPARE_TENSOR(DTYPE_DOUBLE, Double, double)
+    else PREPARE_TENSOR(DTYPE_FLOAT, Float, float)
+    else PREPARE_TENSOR(DTYPE_LONG, Long, long)
+    else PREPARE_TENSOR(DTYPE_INT, Int, int)
+    else PREPARE_TENSOR(DTYPE_SHORT, Short, short)
+    else PREPARE_TENSOR(DTYPE_CHAR, Char, char)
+    else PREPARE_TENSOR(DTYPE_BYTE, Byte, unsigned char)
+
+    // copy, converting if needed
+    if (dtype == native)
+      memcpy(data, mxGetData(src), n * elemsize);
+    else
+      convertData(data, dtype, src, n);
+
+    THLongStorage_free(size);
+    THLongStorage_free(stride);
+}
+
+// Converts a numeric (or logical) mxArray into a new TH tensor of the
+// given dtype; the full-precision tensor is never allocated.
+// Returns NULL if the class has no tensor equivalent; otherwise
+// *tname is set to the torch type of the returned tensor.
+static void *newTensorFromMxArray(const mxArray* src, mtDtype dtype, const char **tname)
+{
+    mtDtype native = nativeDtype(mxGetClassID(src));
+    void *tensor = NULL;
+
+    if (native == DTYPE_NATIVE) return NULL;
+    if (dtype == DTYPE_NATIVE) dtype = native;
+
+    // depending on type, create equivalent torch tensor
+    if (dtype == DTYPE_DOUBLE) {
+      tensor = THDoubleTensor_new();
+      *tname = "torch.DoubleTensor";
+    } else if (dtype == DTYPE_FLOAT) {
+      tensor = THFloatTensor_new();
+      *tname = "torch.FloatTensor";
+    } else if (dtype == DTYPE_LONG) {
+      tensor = THLongTensor_new();
+      *tname = "torch.LongTensor";
+    } else if (dtype == DTYPE_INT) {
+      tensor = THIntTensor_new();
+      *tname = "torch.IntTensor";
+    } else if (dtype == DTYPE_SHORT) {
+      tensor = THShortTensor_new();
+      *tname = "torch.ShortTensor";
+    } else if (dtype == DTYPE_CHAR) {
+      tensor = THCharTensor_new();
+      *tname = "torch.CharTensor";
+    } else if (dtype == DTYPE_BYTE) {
+      tensor = THByteTensor_new();
+      *tname = "torch.ByteTensor";
+    }
+
+    copyMxArrayInto(tensor, dtype, src);
+    return tensor;
+}
+
+void readAndPushMxArray(lua_State *L, const mxArray* src, mtDtype dtype){
+    const char *tname;
+    void *tensor = newTensorFromMxArray(src, dtype, &tname);
+    if (tensor) {
+      luaT_pushudata(L, tensor, luaT_checktypename2id(L, tname));
+      return;
+    }
+
+     // get dimensions
+    mwSize ndims = mxGetNumberOfDimensions(src);
+    const mwSize *dims = mxGetDimensions(src);
+
+     // depending on type, create equivalent Lua data structure
+    if (mxGetClassID(src) == mxCHAR_CLASS) {
       mwSize numElements = mxGetNumberOfElements(src);
       char* tmpStr = (char*)calloc(numElements+1, sizeof(char));
       mxGetString(src, tmpStr, (numElements+1) * sizeof(char));
 	  lua_pushstring(L, tmpStr);
 	  free(tmpStr);
-    } else if ((mxGetClassID(src) == mxUINT8_CLASS)) {
-      THByteTensor *tensor = THByteTensor_newWithSize(size, stride);
-      memcpy((void *)(THByteTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THByteTensor_nElement(tensor) * sizeof(char));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.ByteTensor"));
-    } else if ((mxGetClassID(src) == mxLOGICAL_CLASS)) {
-      THByteTensor *tensor = THByteTensor_newWithSize(size, stride);
-      memcpy((void *)(THByteTensor_data(tensor)),
-             (void *)(mxGetPr(src)), THByteTensor_nElement(tensor) * sizeof(char));
-      luaT_pushudata(L, tensor, luaT_checktypename2id(L, "torch.ByteTensor"));
-    }else {
-      if ((mxGetClassID(src) == mxCELL_CLASS)) {
-        pushMxCellData(L, src, ndims, dims);
-      } else if ((mxGetClassID(src) == mxSTRUCT_CLASS)) {
-        pushMxStructData(L, src, ndims, dims); 
-      } else if ((mxGetClassID(src) == mxINT64_CLASS)) {
-        lua_pushstring(L, "unsupported type: mxINT64_CLASS");
-      } else if ((mxGetClassID(src) == mxUINT64_CLASS)) {
-        lua_pushstring(L, "unsupported type: mxUINT64_CLASS");
-      } else if ((mxGetClassID(src) == mxFUNCTION_CLASS)) {
-        lua_pushstring(L, "unsupported type: mxFUNCTION_CLASS");
-      } else {
-        lua_pushstring(L, "unknown type");
-      }
+    } else if ((mxGetClassID(src) == mxCELL_CLASS)) {
+      pushMxCellData(L, src, ndims, dims, dtype);
+    } else if ((mxGetClassID(src) == mxSTRUCT_CLASS)) {
+      pushMxStructData(L, src, ndims, dims, dtype);
+    } else if ((mxGetClassID(src) == mxINT64_CLASS)) {
+      lua_pushstring(L, "unsupported type: mxINT64_CLASS");
+    } else if ((mxGetClassID(src) == mxUINT64_CLASS)) {
+      lua_pushstring(L, "unsupported type: mxUINT64_CLASS");
+    } else if ((mxGetClassID(src) == mxFUNCTION_CLASS)) {
+      lua_pushstring(L, "unsupported type: mxFUNCTION_CLASS");
+    } else {
+      lua_pushstring(L, "unknown type");
     }
-    
+}
+
+// libmat/libmx are not documented as thread-safe: every call that
+// opens, decodes, creates, writes or frees Matlab data goes through
+// this lock, so that loadMany's workers (and Lua code running while
+// they do, e.g. in a loadMany callback) never use libmat concurrently.
+static pthread_mutex_t libmat = PTHREAD_MUTEX_INITIALIZER;
+
+static MATFile *lockedMatOpen(const char *path, const char *mode)
+{
+  pthread_mutex_lock(&libmat);
+  MATFile *file = matOpen(path, mode);
+  pthread_mutex_unlock(&libmat);
+  return file;
+}
+
+static mxArray *lockedMatGetNextVariable(MATFile *file, const char **name)
+{
+  pthread_mutex_lock(&libmat);
+  mxArray *pa = matGetNextVariable(file, name);
+  pthread_mutex_unlock(&libmat);
+  return pa;
+}
+
+static void lockedMatClose(MATFile *file)
+{
+  pthread_mutex_lock(&libmat);
+  matClose(file);
+  pthread_mutex_unlock(&libmat);
+}
+
+static void lockedMxDestroyArray(mxArray *pa)
+{
+  pthread_mutex_lock(&libmat);
+  mxDestroyArray(pa);
+  pthread_mutex_unlock(&libmat);
+}
+
+static mxArray *lockedMxCreateNumericArray(mwSize ndims, const mwSize *size, mxClassID classid)
+{
+  pthread_mutex_lock(&libmat);
+  mxArray *pm = mxCreateNumericArray(ndims, size, classid, mxREAL);
+  pthread_mutex_unlock(&libmat);
+  return pm;
+}
+
+static void lockedMatPutVariable(MATFile *file, const char *name, const mxArray *pm)
+{
+  pthread_mutex_lock(&libmat);
+  matPutVariable(file, name, pm);
+  pthread_mutex_unlock(&libmat);
+}
+
+// Per-variable dtypes, given as a table {varname = dtype, ...}
+typedef struct {
+  const char *name;
+  mtDtype dtype;
+} VarDtype;
+
+// Reads (and checks) a table of per-variable dtypes into a C array,
+// names stay anchored in the table. The array is a userdata left on
+// the stack. Returns the number of entries.
+static int checkVarDtypes(lua_State *L, int idx, VarDtype **overrides)
+{
+  int n = 0;
+  *overrides = NULL;
+  if (!lua_istable(L, idx)) return 0;
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0) {
+    if (lua_type(L, -2) == LUA_TSTRING) n++;
+    lua_pop(L, 1);
+  }
+  if (n == 0) return 0;
+  VarDtype *vd = (VarDtype *)lua_newuserdata(L, sizeof(VarDtype) * n);  // collected with the call
+  int i = 0;
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      vd[i].name = lua_tostring(L, -2);
+      vd[i].dtype = checkDtype(L, luaL_checkstring(L, -1));
+      i++;
+    }
+    lua_pop(L, 1);
+  }
+  *overrides = vd;
+  return n;
+}
+
+static mtDtype varDtype(const VarDtype *overrides, int n, const char *name, mtDtype dflt)
+{
+  int i;
+  for (i=0; i<n; i++)
+    if (strcmp(overrides[i].name, name) == 0) return overrides[i].dtype;
+  return dflt;
 }
 
 // Loader
+//   load(path [, dtype [, dtypes]])
+// dtype converts all tensors to the given type ('double', 'float', ...),
+// dtypes overrides it per variable: {varname = dtype, ...}
 static int load_l(lua_State *L) {
   // get args
   const char *path = lua_tostring(L,1);
+  mtDtype dtype = checkDtype(L, luaL_optstring(L, 2, "native"));
+  VarDtype *overrides;
+  int noverrides = checkVarDtypes(L, 3, &overrides);
 
   // open file
-  MATFile *file = matOpen(path, "r");
+  MATFile *file = lockedMatOpen(path, "r");
   if (file == NULL) THError("Error opening file %s", file);
 
   // create table to hold loaded variables
@@ -231,28 +482,475 @@ static int load_l(lua_State *L) {
   while (true) {
     // get var+name
     const char *name;
-    mxArray *pa = matGetNextVariable(file, &name);
+    mxArray *pa = lockedMatGetNextVariable(file, &name);
     if (pa == NULL) break;
 
     lua_pushstring(L, name);    // push varName
-    readAndPushMxArray(L, pa);    // push Data
+    readAndPushMxArray(L, pa, varDtype(overrides, noverrides, name, dtype));    // push Data
     lua_rawset(L, vars);        // Pop    [key - value] pair
   
-    mxDestroyArray(pa);
+    lockedMxDestroyArray(pa);
   }
 
   // cleanup
-  matClose(file);
+  lockedMatClose(file);
 
   // return table 'vars'
   return 1;
 }
 
+// torch types that can be loaded into, and their dtypes
+static const struct {
+  const char *tname;
+  mtDtype dtype;
+} targetTypes[] = {
+  {"torch.DoubleTensor", DTYPE_DOUBLE},
+  {"torch.FloatTensor", DTYPE_FLOAT},
+  {"torch.LongTensor", DTYPE_LONG},
+  {"torch.IntTensor", DTYPE_INT},
+  {"torch.ShortTensor", DTYPE_SHORT},
+  {"torch.CharTensor", DTYPE_CHAR},
+  {"torch.ByteTensor", DTYPE_BYTE},
+  {NULL, DTYPE_NATIVE}
+};
+
+static void *toTargetTensor(lua_State *L, int idx, mtDtype *dtype)
+{
+  int i;
+  for (i=0; targetTypes[i].tname; i++) {
+    void *tensor = luaT_toudata(L, idx, luaT_checktypename2id(L, targetTypes[i].tname));
+    if (tensor) {
+      *dtype = targetTypes[i].dtype;
+      return tensor;
+    }
+  }
+  return NULL;
+}
+
+#define TARGET_INFO(DT, Real)                                                 \
+    if (dtype == DT) {                                                        \
+      TH##Real##Tensor *t = (TH##Real##Tensor *)tensor;                       \
+      contiguous = TH##Real##Tensor_isContiguous(t);                          \
+      ndims = t->nDimension;                                                  \
+      tsize = t->size;                                                        \
+      offset = t->storageOffset;                                              \
+      nelem = TH##Real##Tensor_nElement(t);                                   \
+      storagesize = t->storage ? t->storage->size : 0;                        \
+    }
+
+// Checks that an mxArray can be decoded into a target tensor: the
+// tensor must be contiguous, and either have the array's shape, or
+// span its whole storage (so that resizing it cannot overwrite data
+// of other views). Returns NULL if so, an error message otherwise.
+static const char *checkTarget(void *tensor, mtDtype dtype, const mxArray *pa)
+{
+  int contiguous = 0, ndims = 0, k;
+  long *tsize = NULL, offset = 0, nelem = 0, storagesize = 0;
+  TARGET_INFO(DTYPE_DOUBLE, Double)
+  else TARGET_INFO(DTYPE_FLOAT, Float)
+  else TARGET_INFO(DTYPE_LONG, Long)
+  else TARGET_INFO(DTYPE_INT, Int)
+  else TARGET_INFO(DTYPE_SHORT, Short)
+  else TARGET_INFO(DTYPE_CHAR, Char)
+  else TARGET_INFO(DTYPE_BYTE, Byte)
+
+  if (nativeDtype(mxGetClassID(pa)) == DTYPE_NATIVE)
+    return "cannot be loaded into a tensor";
+  if (!contiguous)
+    return "has a non-contiguous target tensor";
+
+  mwSize mxndims = mxGetNumberOfDimensions(pa);
+  const mwSize *dims = mxGetDimensions(pa);
+  int sameshape = (ndims == (int)mxndims);
+  for (k=0; sameshape && k<ndims; k++)
+    if (tsize[ndims-k-1] != (long)dims[k]) sameshape = 0;
+  if (!sameshape && (offset != 0 || nelem != storagesize))
+    return "has a different shape than its target tensor, which is a view of a larger storage";
+  return NULL;
+}
+
+// Loader, into existing tensors
+//   loadInto(path, targets [, dtype [, dtypes]])
+// variables named in targets = {varname = tensor, ...} are decoded
+// directly into the given tensors (converted to their type, and
+// resized only if their shape differs); other variables are loaded
+// as in load(). Returns the table of all variables.
+// Targets must be contiguous tensors, and all be found in the file.
+static int load_into_l(lua_State *L) {
+  // get args
+  const char *path = luaL_checkstring(L,1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  mtDtype dtype = checkDtype(L, luaL_optstring(L, 3, "native"));
+  VarDtype *overrides;
+  int noverrides = checkVarDtypes(L, 4, &overrides);
+
+  // check targets
+  mtDtype tdtype;
+  lua_pushnil(L);
+  while (lua_next(L, 2) != 0) {
+    if (lua_type(L, -2) != LUA_TSTRING || !toTargetTensor(L, -1, &tdtype))
+      return luaL_error(L, "<mattorch.loadInto> targets must be {varname = tensor}, "
+                        "with tensors of a supported CPU type");
+    lua_pop(L, 1);
+  }
+
+  // open file
+  MATFile *file = lockedMatOpen(path, "r");
+  if (file == NULL) return luaL_error(L, "Error opening file %s", path);
+
+  // create table to hold loaded variables
+  lua_newtable(L);  // vars = {}
+  int vars = lua_gettop(L);
+
+  // extract each var
+  while (true) {
+    // get var+name
+    const char *name;
+    mxArray *pa = lockedMatGetNextVariable(file, &name);
+    if (pa == NULL) break;
+
+    lua_pushstring(L, name);    // push varName
+    lua_getfield(L, 2, name);   // push target
+    void *target = toTargetTensor(L, -1, &tdtype);
+    if (target) {
+      const char *error = checkTarget(target, tdtype, pa);
+      if (error) {
+        // format before name (owned by libmat) is released
+        lua_pushfstring(L, "<mattorch.loadInto> variable %s %s", name, error);
+        lockedMxDestroyArray(pa);
+        lockedMatClose(file);
+        return lua_error(L);
+      }
+      copyMxArrayInto(target, tdtype, pa);    // target is Data
+    } else {
+      lua_pop(L, 1);
+      readAndPushMxArray(L, pa, varDtype(overrides, noverrides, name, dtype));    // push Data
+    }
+    lua_rawset(L, vars);        // Pop    [key - value] pair
+
+    lockedMxDestroyArray(pa);
+  }
+
+  // cleanup
+  lockedMatClose(file);
+
+  // every target must have been loaded
+  lua_pushnil(L);
+  while (lua_next(L, 2) != 0) {
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, vars);
+    if (lua_isnil(L, -1))
+      return luaL_error(L, "<mattorch.loadInto> variable %s not found in file %s",
+                        lua_tostring(L, -2), path);
+    lua_pop(L, 1);
+  }
+
+  // return table 'vars'
+  lua_pushvalue(L, vars);
+  return 1;
+}
+
+// Concurrent loader:
+//   worker threads open and decode files, and convert numeric
+//   variables into TH tensors; the main thread pushes the results
+//   into Lua, as they complete. Variables that have no tensor
+//   equivalent (cells, structs, strings) are kept as mxArrays,
+//   and converted on the main thread.
+//   libmat calls are serialized by the libmat lock (see above), so
+//   each worker first reads its file into the page cache, without
+//   the lock: the disk reads and the tensor conversions run in
+//   parallel, only parsing/decompressing (from memory) does not.
+typedef struct {
+  char *name;
+  void *tensor;
+  const char *tname;
+  mxArray *array;
+  mtDtype dtype;
+} LoadedVar;
+
+typedef struct {
+  char *path;
+  int done;
+  int consumed;
+  int failed;
+  LoadedVar *vars;
+  int nvars;
+} LoadJob;
+
+typedef struct {
+  LoadJob *jobs;
+  int njobs;
+  int next;          // next job to start
+  int inflight;      // jobs started, but not pushed into Lua yet
+  int maxinflight;
+  int cancel;
+  mtDtype dtype;
+  VarDtype *overrides;
+  int noverrides;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} LoadPool;
+
+// read a whole file, to bring it into the page cache
+static void prefetchFile(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return;  // matOpen reports the error
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+  size_t bufsize = 1 << 20;
+  char *buf = (char *)malloc(bufsize);
+  while (buf) {
+    ssize_t n = read(fd, buf, bufsize);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+  }
+  free(buf);
+  close(fd);
+}
+
+static void decodeJob(LoadPool *pool, LoadJob *job)
+{
+  prefetchFile(job->path);
+  MATFile *file = lockedMatOpen(job->path, "r");
+  if (file == NULL) {
+    job->failed = 1;
+    return;
+  }
+
+  int capacity = 0;
+  while (true) {
+    const char *name;
+    mxArray *pa = lockedMatGetNextVariable(file, &name);
+    if (pa == NULL) break;
+
+    if (job->nvars == capacity) {
+      capacity = capacity ? 2*capacity : 8;
+      job->vars = (LoadedVar *)realloc(job->vars, sizeof(LoadedVar)*capacity);
+    }
+    LoadedVar *var = &job->vars[job->nvars++];
+    var->name = strdup(name);
+    var->dtype = varDtype(pool->overrides, pool->noverrides, name, pool->dtype);
+    var->tensor = newTensorFromMxArray(pa, var->dtype, &var->tname);
+    if (var->tensor) {
+      var->array = NULL;
+      lockedMxDestroyArray(pa);
+    } else {
+      var->array = pa;
+    }
+  }
+
+  lockedMatClose(file);
+}
+
+static void *loadWorker(void *arg)
+{
+  LoadPool *pool = (LoadPool *)arg;
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (!pool->cancel && pool->next < pool->njobs && pool->inflight >= pool->maxinflight)
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    if (pool->cancel || pool->next >= pool->njobs) break;
+    LoadJob *job = &pool->jobs[pool->next++];
+    pool->inflight++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    decodeJob(pool, job);
+
+    pthread_mutex_lock(&pool->mutex);
+    job->done = 1;
+    pthread_cond_broadcast(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+// push the variables of a job as a table, and release them
+static void pushJob(lua_State *L, LoadJob *job)
+{
+  int i;
+  lua_newtable(L);
+  for (i=0; i<job->nvars; i++) {
+    LoadedVar *var = &job->vars[i];
+    lua_pushstring(L, var->name);
+    if (var->tensor) {
+      luaT_pushudata(L, var->tensor, luaT_checktypename2id(L, var->tname));
+      var->tensor = NULL;
+    } else {
+      readAndPushMxArray(L, var->array, var->dtype);
+    }
+    lua_rawset(L, -3);
+  }
+}
+
+static void freeJob(LoadJob *job)
+{
+  int i;
+  for (i=0; i<job->nvars; i++) {
+    LoadedVar *var = &job->vars[i];
+    free(var->name);
+    if (var->array) lockedMxDestroyArray(var->array);
+    if (var->tensor) {
+      if (strcmp(var->tname, "torch.DoubleTensor") == 0) THDoubleTensor_free(var->tensor);
+      else if (strcmp(var->tname, "torch.FloatTensor") == 0) THFloatTensor_free(var->tensor);
+      else if (strcmp(var->tname, "torch.LongTensor") == 0) THLongTensor_free(var->tensor);
+      else if (strcmp(var->tname, "torch.IntTensor") == 0) THIntTensor_free(var->tensor);
+      else if (strcmp(var->tname, "torch.ShortTensor") == 0) THShortTensor_free(var->tensor);
+      else if (strcmp(var->tname, "torch.CharTensor") == 0) THCharTensor_free(var->tensor);
+      else if (strcmp(var->tname, "torch.ByteTensor") == 0) THByteTensor_free(var->tensor);
+    }
+  }
+  free(job->vars);
+  job->vars = NULL;
+  job->nvars = 0;
+}
+
+// Collects the results of a running pool, on the main thread.
+// Called through lua_pcall(pool, callback): any Lua error raised here
+// (memory, conversion of cells/structs, callback) is caught by
+// load_many_l, which stops the workers before re-raising it.
+static int collect_l(lua_State *L) {
+  LoadPool *pool = (LoadPool *)lua_touserdata(L, 1);
+  int callback = lua_isfunction(L, 2);
+  if (!callback) lua_newtable(L);
+  int results = lua_gettop(L);
+  int i, k;
+  for (k=0; k<pool->njobs; k++) {
+    // wait for next job: in order, or whichever completes first
+    LoadJob *job = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    while (job == NULL) {
+      if (callback) {
+        for (i=0; i<pool->njobs; i++) {
+          if (pool->jobs[i].done && !pool->jobs[i].consumed) { job = &pool->jobs[i]; break; }
+        }
+      } else if (pool->jobs[k].done) {
+        job = &pool->jobs[k];
+      }
+      if (job == NULL) pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+    job->consumed = 1;
+    pthread_mutex_unlock(&pool->mutex);
+
+    int index = (int)(job - pool->jobs) + 1;
+    if (job->failed) {
+      return luaL_error(L, "Error opening file %s", job->path);
+    } else if (callback) {
+      lua_pushvalue(L, 2);
+      pushJob(L, job);
+      lua_pushstring(L, job->path);
+      lua_pushinteger(L, index);
+      lua_call(L, 3, 0);
+    } else {
+      pushJob(L, job);
+      lua_rawseti(L, results, index);
+    }
+    freeJob(job);
+
+    // release one in-flight slot
+    pthread_mutex_lock(&pool->mutex);
+    pool->inflight--;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return callback ? 0 : 1;
+}
+
+static void freePaths(LoadPool *pool)
+{
+  int i;
+  for (i=0; i<pool->njobs; i++)
+    free(pool->jobs[i].path);
+  free(pool->jobs);
+}
+
+// Load many files concurrently
+//   loadMany(paths, nthreads, maxinflight [, callback [, dtype [, dtypes]]])
+// without callback, returns a table with the variables of each file,
+// in order; with a callback, callback(vars, path, index) is called for
+// each file, as soon as it is decoded.
+static int load_many_l(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int nthreads = luaL_optint(L, 2, 4);
+  int maxinflight = luaL_optint(L, 3, 2*nthreads);
+  int callback = lua_isfunction(L, 4);
+  if (nthreads < 1) nthreads = 1;
+  if (maxinflight < 1) maxinflight = 1;
+
+  // jobs: paths are copied, the callback may modify the paths table
+  LoadPool pool;
+  int i;
+  memset(&pool, 0, sizeof(pool));
+  pool.njobs = lua_objlen(L, 1);
+  pool.maxinflight = maxinflight;
+  pool.dtype = checkDtype(L, luaL_optstring(L, 5, "native"));
+  pool.noverrides = checkVarDtypes(L, 6, &pool.overrides);
+  pool.jobs = (LoadJob *)calloc(pool.njobs > 0 ? pool.njobs : 1, sizeof(LoadJob));
+  for (i=0; i<pool.njobs; i++) {
+    lua_rawgeti(L, 1, i+1);
+    int isstring = lua_type(L, -1) == LUA_TSTRING;
+    if (isstring) pool.jobs[i].path = strdup(lua_tostring(L, -1));
+    lua_pop(L, 1);
+    if (!isstring) {
+      freePaths(&pool);
+      return luaL_error(L, "<mattorch.loadMany> paths must be strings");
+    }
+  }
+  if (nthreads > pool.njobs) nthreads = pool.njobs;
+
+  // push collector and its args now: nothing may raise a Lua error
+  // between starting the workers and the protected call
+  lua_pushcfunction(L, collect_l);
+  lua_pushlightuserdata(L, &pool);
+  if (callback) lua_pushvalue(L, 4); else lua_pushnil(L);
+
+  // start workers
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * (nthreads > 0 ? nthreads : 1));
+  int nstarted = 0;
+  for (i=0; i<nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, loadWorker, &pool) != 0) break;
+    nstarted++;
+  }
+  if (nstarted == 0 && pool.njobs > 0) {
+    free(threads);
+    freePaths(&pool);
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.cond);
+    return luaL_error(L, "<mattorch.loadMany> could not start worker threads");
+  }
+
+  // collect results, on the main thread
+  int err = lua_pcall(L, 2, 1, 0);
+
+  // stop and join workers, drop pending results
+  pthread_mutex_lock(&pool.mutex);
+  pool.cancel = 1;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.mutex);
+  for (i=0; i<nstarted; i++)
+    pthread_join(threads[i], NULL);
+  for (i=0; i<pool.njobs; i++)
+    freeJob(&pool.jobs[i]);
+  free(threads);
+  freePaths(&pool);
+  pthread_mutex_destroy(&pool.mutex);
+  pthread_cond_destroy(&pool.cond);
+
+  // report errors, once everything is released
+  if (err) return lua_error(L);
+  return callback ? 0 : 1;
+}
+
 // Save single tensor
 static int save_tensor_l(lua_State *L) {
   // open file for output
   const char *path = lua_tostring(L,1);
-  MATFile *file = matOpen(path, "w");
+  MATFile *file = lockedMatOpen(path, "w");
 
   // load tensor
   THDoubleTensor *tensor = (THDoubleTensor *)luaT_checkudata(L, 2, luaT_checktypename2id(L, "torch.DoubleTensor"));
@@ -267,7 +965,7 @@ static int save_tensor_l(lua_State *L) {
   }
 
   // create matlab array
-  mxArray *pm = mxCreateNumericArray(ndims, size, mxDOUBLE_CLASS, mxREAL);
+  mxArray *pm = lockedMxCreateNumericArray(ndims, size, mxDOUBLE_CLASS);
 
   // copy tensor
   memcpy((void *)(mxGetPr(pm)), 
@@ -276,11 +974,11 @@ static int save_tensor_l(lua_State *L) {
 
   // save it, in a dummy var named 'x'
   const char *name = "x";
-  matPutVariable(file, name, pm);
+  lockedMatPutVariable(file, name, pm);
 
   // done
   THDoubleTensor_free(tensorc);
-  matClose(file);
+  lockedMatClose(file);
   return 0;
 }
 
@@ -288,7 +986,7 @@ static int save_tensor_l(lua_State *L) {
 static int save_table_l(lua_State *L) {
   // open file for output
   const char *path = lua_tostring(L,1);
-  MATFile *file = matOpen(path, "w");
+  MATFile *file = lockedMatOpen(path, "w");
 
   mxArray **pms;
   pms = (mxArray**) malloc(sizeof(mxArray*)*1024);
@@ -310,7 +1008,7 @@ static int save_table_l(lua_State *L) {
     }
 
     // create matlab array
-    mxArray *pm = mxCreateNumericArray(ndims, size, mxDOUBLE_CLASS, mxREAL);
+    mxArray *pm = lockedMxCreateNumericArray(ndims, size, mxDOUBLE_CLASS);
     pms[counter++] = pm;
 
     // copy tensor into array
@@ -319,7 +1017,7 @@ static int save_table_l(lua_State *L) {
            THDoubleTensor_nElement(tensor) * sizeof(double));
 
     // store it
-    matPutVariable(file, name, pm);
+    lockedMatPutVariable(file, name, pm);
 
     // removes 'value'; keeps 'key' for next iteration
     lua_pop(L, 1);
@@ -329,13 +1027,13 @@ static int save_table_l(lua_State *L) {
   }
   int i = 0;
   for(i=0; i<counter;i++)
-    mxDestroyArray(pms[i]);
+    lockedMxDestroyArray(pms[i]);
   
   free(pms);
 
   // cleanup
   lua_pop(L, 1);
-  matClose(file);
+  lockedMatClose(file);
   return 0;
 }
 
@@ -374,12 +1072,120 @@ static int save_tensor_ascii_l(lua_State *L)
   return 0;
 }
 
+// 64-bit FNV-1a, used to build cache keys and content hashes
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t h, const unsigned char *buf, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= buf[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static void pushHash(lua_State *L, uint64_t h)
+{
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+  lua_pushstring(L, hex);
+}
+
+// Size and modification time (seconds, nanoseconds) of a file
+static int fileinfo_l(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushnumber(L, (lua_Number)st.st_size);
+  lua_pushnumber(L, (lua_Number)st.st_mtime);
+#if defined(__APPLE__)
+  lua_pushnumber(L, (lua_Number)st.st_mtimespec.tv_nsec);
+#else
+  lua_pushnumber(L, (lua_Number)st.st_mtim.tv_nsec);
+#endif
+  return 3;
+}
+
+// Set the access and modification times of a file to now
+static int touch_l(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  lua_pushboolean(L, utimes(path, NULL) == 0);
+  return 1;
+}
+
+// Exclusive lock on a file (created if needed), returns a handle for unlock
+static int lock_l(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return luaL_error(L, "cannot open lock file %s", path);
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return luaL_error(L, "cannot lock file %s", path);
+    }
+  }
+  lua_pushinteger(L, fd);
+  return 1;
+}
+
+static int unlock_l(lua_State *L) {
+  int fd = luaL_checkint(L, 1);
+  flock(fd, LOCK_UN);
+  close(fd);
+  return 0;
+}
+
+// Process id, to name per-process temporary files
+static int getpid_l(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)getpid());
+  return 1;
+}
+
+// Hash a string
+static int hash_l(lua_State *L) {
+  size_t len;
+  const char *str = luaL_checklstring(L, 1, &len);
+  pushHash(L, fnv1a(FNV_OFFSET, (const unsigned char *)str, len));
+  return 1;
+}
+
+// Hash the content of a file
+static int hash_file_l(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) THError("Error opening file %s", path);
+
+  unsigned char buf[65536];
+  uint64_t h = FNV_OFFSET;
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    h = fnv1a(h, buf, n);
+  fclose(f);
+
+  pushHash(L, h);
+  return 1;
+}
+
 // Register functions in LUA
 static const struct luaL_reg matlab [] = {
   {"load", load_l},
+  {"loadInto", load_into_l},
+  {"loadMany", load_many_l},
   {"saveTensor", save_tensor_l},
   {"saveTable", save_table_l},
   {"saveTensorAscii", save_tensor_ascii_l},
+  {"fileinfo", fileinfo_l},
+  {"touch", touch_l},
+  {"hash", hash_l},
+  {"hashFile", hash_file_l},
+  {"lock", lock_l},
+  {"unlock", unlock_l},
+  {"getpid", getpid_l},
   {NULL, NULL}  /* sentinel */
 };
 
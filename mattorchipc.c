@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mattorchipc.h"
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+size_t mtipc_typesize(int type) {
+  switch (type) {
+    case MTIPC_DOUBLE: return sizeof(double);
+    case MTIPC_FLOAT: return sizeof(float);
+    case MTIPC_LONG: return sizeof(long);
+    case MTIPC_INT: return sizeof(int);
+    case MTIPC_SHORT: return sizeof(short);
+    case MTIPC_CHAR: return sizeof(char);
+    case MTIPC_BYTE: return sizeof(unsigned char);
+    default: return 0;
+  }
+}
+
+int64_t mtipc_align(int64_t size) {
+  return (size + MTIPC_ALIGN - 1) / MTIPC_ALIGN * MTIPC_ALIGN;
+}
+
+int mtipc_send(int fd, const mtipc_message *msg) {
+  const char *p = (const char *)msg;
+  size_t left = sizeof(*msg);
+  while (left > 0) {
+    ssize_t n = send(fd, p, left, SEND_FLAGS);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    left -= n;
+  }
+  return 0;
+}
+
+int mtipc_recv(int fd, mtipc_message *msg) {
+  char *p = (char *)msg;
+  size_t left = sizeof(*msg);
+  while (left > 0) {
+    ssize_t n = recv(fd, p, left, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    left -= n;
+  }
+  return msg->magic == MTIPC_MAGIC ? 0 : -1;
+}
+
+int mtipc_segment_reserve(mtipc_segment *seg, int64_t size) {
+  static int counter = 0;
+  if (seg->data && seg->size >= size) return 0;
+
+  /* grow geometrically, to avoid recreating on every call */
+  int64_t newsize = mtipc_align(size > 2*seg->size ? size : 2*seg->size);
+  if (newsize == 0) newsize = MTIPC_ALIGN;
+  mtipc_segment_release(seg);
+
+  /* short name: some systems limit them to 31 chars */
+  snprintf(seg->name, sizeof(seg->name), "/mt-%d-%d", (int)getpid(), counter++);
+  int fd = shm_open(seg->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) return -1;
+  if (ftruncate(fd, newsize) != 0) {
+    close(fd);
+    shm_unlink(seg->name);
+    return -1;
+  }
+  void *data = mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    shm_unlink(seg->name);
+    return -1;
+  }
+  seg->data = data;
+  seg->size = newsize;
+  seg->owner = 1;
+  return 0;
+}
+
+int mtipc_segment_map(mtipc_segment *seg, const char *name, int64_t size) {
+  if (seg->data && seg->size == size && strncmp(seg->name, name, MTIPC_NAMELEN) == 0)
+    return 0;
+  mtipc_segment_release(seg);
+  if (size <= 0) return 0;
+
+  int fd = shm_open(name, O_RDWR, 0600);
+  if (fd < 0) return -1;
+  /* never trust the peer's size: touching pages past the end of */
+  /* the object would raise SIGBUS */
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < size) {
+    close(fd);
+    return -1;
+  }
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return -1;
+  strncpy(seg->name, name, MTIPC_NAMELEN-1);
+  seg->name[MTIPC_NAMELEN-1] = '\0';
+  seg->data = data;
+  seg->size = size;
+  seg->owner = 0;
+  return 0;
+}
+
+void mtipc_segment_release(mtipc_segment *seg) {
+  if (seg->data) {
+    munmap(seg->data, seg->size);
+    if (seg->owner) shm_unlink(seg->name);
+  }
+  seg->data = NULL;
+  seg->size = 0;
+  seg->owner = 0;
+}
+
+static int unixaddr(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int mtipc_connect(const char *path) {
+  struct sockaddr_un addr;
+  if (unixaddr(&addr, path) != 0) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int mtipc_listen(const char *path) {
+  struct sockaddr_un addr;
+  if (unixaddr(&addr, path) != 0) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
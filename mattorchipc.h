@@ -0,0 +1,85 @@
+#ifndef MATTORCHIPC_H
+#define MATTORCHIPC_H
+
+/* Protocol between mattorchlive (client, in the Matlab process) and */
+/* mattorchserver (a long-lived Lua process).                        */
+/* Each call is one request message and one reply message over a     */
+/* Unix socket. Array data does not go through the socket: the       */
+/* messages only describe arrays, stored in a POSIX shared-memory    */
+/* segment owned by the sender (inputs in the client's segment,      */
+/* outputs in the server's). Segments are reused across calls, and   */
+/* only recreated when they need to grow.                            */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MTIPC_MAGIC     0x4d544331  /* "MTC1" */
+#define MTIPC_MAXARRAYS 32
+#define MTIPC_MAXDIMS   8
+#define MTIPC_NAMELEN   32
+#define MTIPC_ALIGN     64
+
+/* element types, on the wire */
+enum {
+  MTIPC_DOUBLE = 1,
+  MTIPC_FLOAT,
+  MTIPC_LONG,
+  MTIPC_INT,
+  MTIPC_SHORT,
+  MTIPC_CHAR,
+  MTIPC_BYTE
+};
+
+typedef struct {
+  int32_t type;
+  int32_t ndims;
+  int64_t dims[MTIPC_MAXDIMS];  /* torch order */
+  int64_t offset;               /* offset of the data in the segment */
+  int64_t nbytes;
+} mtipc_array;
+
+typedef struct {
+  uint32_t magic;
+  int32_t status;               /* reply: 0 on success */
+  int32_t narrays;              /* request: inputs, reply: outputs */
+  int32_t noutputs;             /* request: outputs expected */
+  char func[256];               /* request: global Lua function to call */
+  char shm[MTIPC_NAMELEN];      /* segment holding the arrays */
+  int64_t shmsize;
+  mtipc_array arrays[MTIPC_MAXARRAYS];
+  char error[1024];             /* reply: error message, if status != 0 */
+} mtipc_message;
+
+/* a shared-memory segment, created or mapped */
+typedef struct {
+  char name[MTIPC_NAMELEN];
+  int64_t size;
+  void *data;
+  int owner;
+} mtipc_segment;
+
+/* size of one element of a wire type, 0 if unknown */
+size_t mtipc_typesize(int type);
+
+/* round up to MTIPC_ALIGN */
+int64_t mtipc_align(int64_t size);
+
+/* send/receive one message, return 0 on success */
+int mtipc_send(int fd, const mtipc_message *msg);
+int mtipc_recv(int fd, mtipc_message *msg);
+
+/* make sure an owned segment holds at least size bytes, */
+/* recreating it under a new name if it must grow */
+int mtipc_segment_reserve(mtipc_segment *seg, int64_t size);
+
+/* map the peer's segment, unless it is already mapped */
+int mtipc_segment_map(mtipc_segment *seg, const char *name, int64_t size);
+
+/* unmap a segment, and unlink it if owned */
+void mtipc_segment_release(mtipc_segment *seg);
+
+/* connect to / listen on a Unix socket, return the fd or -1 */
+int mtipc_connect(const char *path);
+int mtipc_listen(const char *path);
+
+#endif
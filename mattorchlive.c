@@ -1,9 +1,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "mattorchlive.h"
+#include "mattorchipc.h"
 
 static lua_State *L = NULL;
 static const char *progname = "lua";
@@ -69,7 +75,289 @@ static int docall (lua_State *L, int narg, int clear) {
   return status;
 }
 
+/* ------------------------------------------------------------ */
+/* startup timing */
+
+static mattorch_timing timing;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+const mattorch_timing *mattorch_gettiming(void) {
+  return &timing;
+}
+
+void mattorch_printtiming(void) {
+  printf("<%s> startup: openlibs %.3fs, preload %.3fs, "
+         "chunk loading %.3fs (%d cached, %d compiled), total %.3fs\n",
+         LIBNAME, timing.openlibs, timing.preload, timing.load,
+         timing.cache_hits, timing.cache_misses, timing.total);
+}
+
+/* ------------------------------------------------------------ */
+/* bytecode cache:                                               */
+/*   each Lua file is compiled once, and its bytecode is stored  */
+/*   in <cachedir>/<hash of path>.luac, along with the path,     */
+/*   size and mtime of the source; the bytecode is reused for as */
+/*   long as the source is unchanged.                            */
+
+#define CACHE_MAGIC "MTLC2"
+
+static char *cachedir = NULL;
+
+typedef struct {
+  int64_t size;
+  int64_t mtime;
+  int64_t mtimensec;
+  int32_t pathlen;
+} cache_header;
+
+/* nanoseconds of the mtime: same-size edits within one second */
+/* must still invalidate the cache */
+static int64_t mtimensec(struct stat *st) {
+#if defined(__APPLE__)
+  return st->st_mtimespec.tv_nsec;
+#else
+  return st->st_mtim.tv_nsec;
+#endif
+}
+
+static void cachefile(char *buf, size_t len, const char *path) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *p;
+  for (p = (const unsigned char *)path; *p; p++) {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  snprintf(buf, len, "%s/%016llx.luac", cachedir, (unsigned long long)h);
+}
+
+static int writer (lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  return fwrite(p, 1, sz, (FILE *)ud) != sz;
+}
+
+/* try to load the cached bytecode of path, returns 0 on success */
+static int loadcached (lua_State *L, const char *path, const char *cache, struct stat *st) {
+  FILE *f = fopen(cache, "rb");
+  if (f == NULL) return 1;
+
+  /* check header: source must be the same file, unchanged */
+  char magic[sizeof(CACHE_MAGIC)];
+  cache_header hdr;
+  int ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+    && memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0
+    && fread(&hdr, sizeof(hdr), 1, f) == 1
+    && hdr.size == (int64_t)st->st_size
+    && hdr.mtime == (int64_t)st->st_mtime
+    && hdr.mtimensec == mtimensec(st)
+    && hdr.pathlen == (int32_t)strlen(path);
+  char *buf = NULL;
+  long start = 0, end = 0;
+  if (ok) {
+    buf = malloc(hdr.pathlen);
+    ok = fread(buf, 1, hdr.pathlen, f) == (size_t)hdr.pathlen
+      && memcmp(buf, path, hdr.pathlen) == 0;
+    free(buf);
+    buf = NULL;
+  }
+
+  /* read bytecode */
+  if (ok) {
+    start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    end = ftell(f);
+    fseek(f, start, SEEK_SET);
+    buf = malloc(end - start);
+    ok = buf && fread(buf, 1, end - start, f) == (size_t)(end - start);
+  }
+  fclose(f);
+
+  /* bytecode from another Lua VM is rejected here, and recompiled */
+  int err = !ok || luaL_loadbuffer(L, buf, end - start, path) != 0;
+  if (ok && err) lua_pop(L, 1);
+  free(buf);
+  return err;
+}
+
+/* store the bytecode of the function on top of the stack */
+static void storecached (lua_State *L, const char *path, const char *cache, struct stat *st) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cache, (int)getpid());
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL) return;
+
+  cache_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.size = st->st_size;
+  hdr.mtime = st->st_mtime;
+  hdr.mtimensec = mtimensec(st);
+  hdr.pathlen = strlen(path);
+  int err = fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC), f) != sizeof(CACHE_MAGIC)
+    || fwrite(&hdr, sizeof(hdr), 1, f) != 1
+    || fwrite(path, 1, hdr.pathlen, f) != (size_t)hdr.pathlen
+    || lua_dump(L, writer, f) != 0;
+  err = fclose(f) || err;
+
+  /* atomically replace the old cache file */
+  if (err || rename(tmp, cache) != 0) remove(tmp);
+}
+
+/* same as luaL_loadfile, through the bytecode cache if enabled */
+static int loadfile (lua_State *L, const char *path) {
+  double start = now();
+  struct stat st;
+  char cache[4096];
+  int err;
+
+  if (cachedir == NULL || stat(path, &st) != 0) {
+    err = luaL_loadfile(L, path);
+  } else {
+    cachefile(cache, sizeof(cache), path);
+    if (loadcached(L, path, cache, &st) == 0) {
+      timing.cache_hits++;
+      err = 0;
+    } else {
+      timing.cache_misses++;
+      err = luaL_loadfile(L, path);
+      if (!err) storecached(L, path, cache, &st);
+    }
+  }
+
+  timing.load += now() - start;
+  return err;
+}
+
+/* package.loaders entry: same as the standard Lua loader, */
+/* but goes through the bytecode cache */
+static int cachedloader (lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  lua_getfield(L, LUA_GLOBALSINDEX, "package");
+  lua_getfield(L, -1, "path");
+  const char *path = lua_tostring(L, -1);
+  if (path == NULL) return 0;
+
+  /* search package.path for the module */
+  name = luaL_gsub(L, name, ".", LUA_DIRSEP);
+  while (*path) {
+    const char *sep = strchr(path, *LUA_PATHSEP);
+    size_t len = sep ? (size_t)(sep - path) : strlen(path);
+    lua_pushlstring(L, path, len);
+    const char *filename = luaL_gsub(L, lua_tostring(L, -1), LUA_PATH_MARK, name);
+    FILE *f = fopen(filename, "r");
+    if (f != NULL) {
+      fclose(f);
+      if (loadfile(L, filename) != 0)
+        luaL_error(L, "error loading module " LUA_QS " from file " LUA_QS ":\n\t%s",
+                   lua_tostring(L, 1), filename, lua_tostring(L, -1));
+      return 1;
+    }
+    lua_pop(L, 2);
+    path += len;
+    if (*path) path++;
+  }
+  return 0;  /* not found: let the other loaders try */
+}
+
+/* replacements for the global loadfile() and dofile(): torch.include */
+/* and most package sub-files go through dofile(), not require. */
+/* upvalue 1 is the original function, used for stdin (no filename) */
+/* loadfile(filename, mode, env) (LuaJIT) goes to the original, */
+/* which applies mode and env: cached chunks are binary, in _G */
+static int cachedloadfile (lua_State *L) {
+  const char *fname = luaL_optstring(L, 1, NULL);
+  if (fname == NULL || lua_gettop(L) > 1) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+  }
+  if (loadfile(L, fname) == 0) return 1;
+  lua_pushnil(L);
+  lua_insert(L, -2);  /* nil, error message */
+  return 2;
+}
+
+static int cacheddofile (lua_State *L) {
+  const char *fname = luaL_optstring(L, 1, NULL);
+  if (fname == NULL) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+  }
+  int n = lua_gettop(L);
+  if (loadfile(L, fname) != 0) lua_error(L);
+  lua_call(L, 0, LUA_MULTRET);
+  return lua_gettop(L) - n;
+}
+
+/* replace a global function by a C closure over the original one */
+static void hookglobal (const char *name, lua_CFunction f) {
+  lua_getfield(L, LUA_GLOBALSINDEX, name);
+  if (lua_tocfunction(L, -1) == f) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pushcclosure(L, f, 1);
+  lua_setfield(L, LUA_GLOBALSINDEX, name);
+}
+
+/* route require, loadfile and dofile through the bytecode cache */
+static void installcache (void) {
+  hookglobal("loadfile", cachedloadfile);
+  hookglobal("dofile", cacheddofile);
+
+  /* insert cached loader before the standard Lua loader */
+  lua_getfield(L, LUA_GLOBALSINDEX, "package");
+  lua_getfield(L, -1, "loaders");
+  if (lua_istable(L, -1)) {
+    int i, n = lua_objlen(L, -1);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, -1, i);
+      int found = lua_tocfunction(L, -1) == cachedloader;
+      lua_pop(L, 1);
+      if (found) { lua_pop(L, 2); return; }
+    }
+    for (i = n; i >= 2; i--) {
+      lua_rawgeti(L, -1, i);
+      lua_rawseti(L, -2, i+1);
+    }
+    lua_pushcfunction(L, cachedloader);
+    lua_rawseti(L, -2, 2);
+  }
+  lua_pop(L, 2);
+}
+
+void mattorch_setcachedir(const char *dir) {
+  free(cachedir);
+  cachedir = dir ? strdup(dir) : NULL;
+  /* before mattorch_init(), the cache is installed by mattorch_init() */
+  if (cachedir && L) installcache();
+}
+
+int mattorch_preload(const char *modules) {
+  if (modules == NULL) return 0;
+  double start = now();
+  char *list = strdup(modules);
+  char *name, *save = NULL;
+  int err = 0;
+  for (name = strtok_r(list, ", ", &save); name && !err;
+       name = strtok_r(NULL, ", ", &save)) {
+    err = mattorch_dorequire(name);
+  }
+  free(list);
+  timing.preload += now() - start;
+  return err;
+}
+
 void mattorch_init(void) {
+  double start = now();
+  memset(&timing, 0, sizeof(timing));
+
   /* Set CWD before starting Lua */
   lua_executable_dir("./lua");
 
@@ -78,17 +366,36 @@ void mattorch_init(void) {
   lua_gc(L, LUA_GCSTOP, 0);
   luaL_openlibs(L);
   lua_gc(L, LUA_GCRESTART, 0);
+  timing.openlibs = now() - start;
+  timing.total = timing.openlibs;
+
+  /* Bytecode cache and preloaded modules, from the environment */
+  const char *dir = getenv("MATTORCH_BYTECODE_CACHE");
+  if (dir && *dir) mattorch_setcachedir(dir);
+  else if (cachedir) installcache();
+  const char *modules = getenv("MATTORCH_PRELOAD");
+  if (modules && *modules) mattorch_preload(modules);
+
+  /* Server mode, from the environment */
+  const char *socketpath = getenv("MATTORCH_SERVER");
+  if (socketpath && *socketpath) mattorch_connect(socketpath);
 }
 
 void mattorch_close(void) {
+  /* Close server connection, if any */
+  mattorch_disconnect();
+
   /* Destroy the Lua State */
-  lua_close(L);
+  if (L) lua_close(L);
+  L = NULL;
 }
 
 int mattorch_dofile(const char *name)
 {
   /* Load user file */
-  int err = luaL_loadfile(L, name) || docall(L, 0, 1);
+  double start = now();
+  int err = loadfile(L, name) || docall(L, 0, 1);
+  timing.total += now() - start;
 
   /* Error ? */
   if (err) {
@@ -100,7 +407,9 @@ int mattorch_dofile(const char *name)
 int mattorch_dostring(const char *s)
 {
   /* Load user file */
+  double start = now();
   int err = luaL_loadbuffer(L, s, strlen(s), "name") || docall(L, 0, 1);
+  timing.total += now() - start;
 
   /* Error ? */
   if (err) {
@@ -112,9 +421,11 @@ int mattorch_dostring(const char *s)
 int mattorch_dorequire(const char *name)
 {
   /* Load library */
+  double start = now();
   lua_getglobal(L, "require");
   lua_pushstring(L, name);
   int err = docall(L, 1, 1);
+  timing.total += now() - start;
 
   /* Error ? */
   if (err) {
@@ -123,8 +434,168 @@ int mattorch_dorequire(const char *name)
   return report(L, err);
 }
 
+/* ------------------------------------------------------------ */
+/* server mode: calls are forwarded to a mattorchserver process */
+
+static int server = -1;
+static mtipc_segment inseg;    /* ours: inputs */
+static mtipc_segment outseg;   /* server's: outputs */
+
+int mattorch_connect(const char *socketpath) {
+  mattorch_disconnect();
+  server = mtipc_connect(socketpath);
+  if (server < 0) {
+    printf("<%s> ERROR: could not connect to server %s\n", LIBNAME, socketpath);
+    return 1;
+  }
+  return 0;
+}
+
+int mattorch_connected(void) {
+  return server >= 0;
+}
+
+void mattorch_disconnect(void) {
+  if (server >= 0) close(server);
+  server = -1;
+  mtipc_segment_release(&inseg);
+  mtipc_segment_release(&outseg);
+}
+
+/* wire type of a Matlab class, same mapping as mattorch_callfunc() */
+static int wiretype(mxClassID classid) {
+  switch (classid) {
+    case mxDOUBLE_CLASS: return MTIPC_DOUBLE;
+    case mxSINGLE_CLASS: return MTIPC_FLOAT;
+    case mxINT64_CLASS: return MTIPC_LONG;
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS: return MTIPC_INT;
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS: return MTIPC_SHORT;
+    case mxINT8_CLASS:
+    case mxCHAR_CLASS: return MTIPC_CHAR;
+    case mxUINT8_CLASS:
+    case mxLOGICAL_CLASS: return MTIPC_BYTE;
+    default: return 0;
+  }
+}
+
+static mxClassID mxclass(int type) {
+  switch (type) {
+    case MTIPC_DOUBLE: return mxDOUBLE_CLASS;
+    case MTIPC_FLOAT: return mxSINGLE_CLASS;
+    case MTIPC_LONG: return mxINT64_CLASS;
+    case MTIPC_INT: return mxINT32_CLASS;
+    case MTIPC_SHORT: return mxINT16_CLASS;
+    case MTIPC_CHAR: return mxINT8_CLASS;
+    case MTIPC_BYTE: return mxUINT8_CLASS;
+    default: return mxUNKNOWN_CLASS;
+  }
+}
+
+static mxArray ** callserver(const char *funcname, int ninputs, int noutputs, const mxArray **inputs)
+{
+  mtipc_message msg;
+  memset(&msg, 0, sizeof(msg));
+  if (ninputs > MTIPC_MAXARRAYS || noutputs > MTIPC_MAXARRAYS
+      || strlen(funcname) >= sizeof(msg.func)) {
+    printf("<%s> ERROR: too many inputs/outputs, or function name too long\n", LIBNAME);
+    return NULL;
+  }
+
+  // (1) describe inputs, and lay them out in our segment
+  int64_t total = 0;
+  int i, k;
+  for (i=0; i<ninputs; i++) {
+    mtipc_array *a = &msg.arrays[i];
+    mwSize ndims = mxGetNumberOfDimensions(inputs[i]);
+    const mwSize *dims = mxGetDimensions(inputs[i]);
+    a->type = wiretype(mxGetClassID(inputs[i]));
+    if (a->type == 0 || ndims > MTIPC_MAXDIMS) {
+      printf("<%s> ERROR: unsupported Matlab type\n", LIBNAME);
+      return NULL;
+    }
+    a->ndims = ndims;
+    for (k=0; k<ndims; k++) a->dims[ndims-k-1] = dims[k];
+    a->nbytes = mxGetNumberOfElements(inputs[i]) * mtipc_typesize(a->type);
+    a->offset = total;
+    total += mtipc_align(a->nbytes);
+  }
+  if (mtipc_segment_reserve(&inseg, total) != 0) {
+    printf("<%s> ERROR: could not create shared memory segment\n", LIBNAME);
+    return NULL;
+  }
+  for (i=0; i<ninputs; i++)
+    memcpy((char *)inseg.data + msg.arrays[i].offset, mxGetData(inputs[i]), msg.arrays[i].nbytes);
+
+  // (2) call
+  msg.magic = MTIPC_MAGIC;
+  msg.narrays = ninputs;
+  msg.noutputs = noutputs;
+  strcpy(msg.func, funcname);
+  memcpy(msg.shm, inseg.name, MTIPC_NAMELEN);
+  msg.shmsize = inseg.size;
+  if (mtipc_send(server, &msg) != 0 || mtipc_recv(server, &msg) != 0) {
+    printf("<%s> ERROR: lost connection to server\n", LIBNAME);
+    mattorch_disconnect();
+    return NULL;
+  }
+  if (msg.status != 0) {
+    msg.error[sizeof(msg.error)-1] = '\0';
+    l_message(progname, msg.error);
+    return NULL;
+  }
+
+  // (3) check the reply, before trusting any of it
+  msg.shm[MTIPC_NAMELEN-1] = '\0';
+  if (msg.narrays != noutputs || mtipc_segment_map(&outseg, msg.shm, msg.shmsize) != 0) {
+    printf("<%s> ERROR: could not map server outputs\n", LIBNAME);
+    return NULL;
+  }
+  int o;
+  for (o=0; o<noutputs; o++) {
+    mtipc_array *a = &msg.arrays[o];
+    int valid = mtipc_typesize(a->type) > 0
+      && a->ndims >= 0 && a->ndims <= MTIPC_MAXDIMS
+      && a->offset >= 0 && a->nbytes >= 0
+      && a->offset <= outseg.size && a->nbytes <= outseg.size - a->offset;
+    for (k=0; valid && k<a->ndims; k++)
+      if (a->dims[k] < 0) valid = 0;
+    if (!valid) {
+      printf("<%s> ERROR: invalid reply from server (output %d)\n", LIBNAME, o+1);
+      return NULL;
+    }
+  }
+
+  // (4) copy outputs out of the server's segment
+  mxArray **outputs = malloc(sizeof(mxArray *) * noutputs);
+  for (o=0; o<noutputs; o++) {
+    mtipc_array *a = &msg.arrays[o];
+    mwSize size[] = {-1,-1,-1,-1,-1,-1,-1,-1};
+    for (k=0; k<a->ndims; k++) size[k] = a->dims[a->ndims-k-1];
+    mxArray *pm = mxCreateNumericArray(a->ndims, size, mxclass(a->type), mxREAL);
+    if (pm == NULL
+        || (int64_t)(mxGetNumberOfElements(pm) * mxGetElementSize(pm)) != a->nbytes) {
+      printf("<%s> ERROR: invalid reply from server (output %d)\n", LIBNAME, o+1);
+      if (pm) mxDestroyArray(pm);
+      while (o-- > 0) mxDestroyArray(outputs[o]);
+      free(outputs);
+      return NULL;
+    }
+    if (a->nbytes > 0)
+      memcpy((void *)(mxGetData(pm)), (char *)outseg.data + a->offset, a->nbytes);
+    outputs[o] = pm;
+  }
+
+  // return outputs
+  return outputs;
+}
+
 mxArray ** mattorch_callfunc(const char *funcname, int ninputs, int noutputs, const mxArray **inputs)
 {
+  // (0) forward to server, if connected
+  if (server >= 0) return callserver(funcname, ninputs, noutputs, inputs);
+
   // (1) push function on top of stack
   lua_getfield(L, LUA_GLOBALSINDEX, funcname);
 
@@ -11,6 +11,10 @@
 #include <mat.h>
 
 /* initialize Lua stack/state, should always be called first */
+/* if set, the environment variables MATTORCH_BYTECODE_CACHE and */
+/* MATTORCH_PRELOAD (comma-separated module names) are passed to */
+/* mattorch_setcachedir() and mattorch_preload(), and MATTORCH_SERVER */
+/* to mattorch_connect() */
 void mattorch_init(void);
 
 /* close Lua state, collect all garbage, should be called last */
@@ -32,6 +36,56 @@ int mattorch_dorequire(const char *name);
 /* Lua function expects. */
 /* Matlab matrices of all types are supported and converted to */
 /* torch.Tensors() automatically. */
+/* When connected to a server, returns NULL on errors (Lua error, */
+/* lost connection, ...): the result must be checked. */
 mxArray ** mattorch_callfunc(const char *funcname, 
                              int ninputs, int noutputs, 
                              const mxArray **inputs);
+
+/* cache compiled bytecode of Lua files in the given directory: */
+/* files loaded by mattorch_dofile(), require, and the global */
+/* dofile()/loadfile() (hence torch.include) are only compiled again */
+/* when their path, size or mtime (to the nanosecond) changes; */
+/* loadfile() with a mode or env argument bypasses the cache. */
+/* Can be called before mattorch_init(). NULL disables the cache */
+void mattorch_setcachedir(const char *dir);
+
+/* require a comma-separated list of modules, e.g. "torch,nn" */
+int mattorch_preload(const char *modules);
+
+/* startup timing, in seconds */
+typedef struct {
+  double openlibs;    /* luaL_openlibs() in mattorch_init() */
+  double preload;     /* modules preloaded by mattorch_preload() */
+  double load;        /* reading/compiling chunks of Lua files */
+  double total;       /* mattorch_init(), dofile(), dostring(), dorequire() */
+  int cache_hits;     /* files loaded from cached bytecode */
+  int cache_misses;   /* files compiled from source */
+} mattorch_timing;
+
+const mattorch_timing *mattorch_gettiming(void);
+
+/* print startup timing on stdout */
+void mattorch_printtiming(void);
+
+/* server mode: forward mattorch_callfunc() to a mattorchserver */
+/* process listening on the given Unix socket, instead of the */
+/* embedded Lua state. Input and output arrays are passed through */
+/* POSIX shared memory, so several Matlab processes can share one */
+/* resident model, and Lua errors/crashes do not take Matlab down */
+int mattorch_connect(const char *socketpath);
+
+/* back to the embedded Lua state */
+void mattorch_disconnect(void);
+
+/* 1 if calls are forwarded to a server. The model's Lua files are */
+/* then run by mattorchserver, not by the client: skip */
+/* mattorch_dofile() in that case, to avoid loading it in every */
+/* Matlab process */
+int mattorch_connected(void);
+
+/* 1 if calls are forwarded to a server. The model's Lua files are */
+/* then run by mattorchserver, not by the client: skip */
+/* mattorch_dofile() in that case, to avoid loading it in every */
+/* Matlab process */
+int mattorch_connected(void);
@@ -1,4 +1,5 @@
 
+#include <stdlib.h>
 #include "mex.h"
 #include "mattorchlive.h"
 
@@ -8,12 +9,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
   /* first call ? */
   if (firstcall) {
-    /* init Lua state */
+    /* init Lua state (connects to a server if MATTORCH_SERVER is set) */
     mattorch_init();
     firstcall = 0;
 
-    /* parse Lua code */
-    mattorch_dofile("example.lua");
+    /* parse Lua code; in server mode, it is loaded once by the */
+    /* server instead: mattorchserver <socket> example.lua */
+    if (!mattorch_connected())
+      mattorch_dofile("example.lua");
   }
 
   /* 1 arg required */
@@ -27,8 +30,16 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   inputs[0] = prhs[0];
   mxArray **outputs = mattorch_callfunc("transpose", 1, 1, inputs);
 
+  /* NULL on errors, in server mode */
+  if (outputs == NULL) {
+    mexErrMsgTxt("call to transpose() failed");
+  }
+
   /* return result */
   if (nlhs >= 1) {
     plhs[0] = outputs[0];
+  } else {
+    mxDestroyArray(outputs[0]);
   }
+  free(outputs);
 }
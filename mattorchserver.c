@@ -0,0 +1,433 @@
+/*
+  + mattorchserver: a long-lived Lua process, serving mattorchlive clients
+
+  usage: mattorchserver <socket> <file.lua> [<file.lua> ...]
+
+  The given Lua files are run once, and should define global functions,
+  exactly as files given to mattorch_dofile(). Matlab processes then
+  call these functions through mattorch_callfunc(), after
+  mattorch_connect(<socket>). Several clients can be connected at once,
+  their calls are served one at a time, by the same Lua state.
+
+  Input tensors are built directly on the client's shared-memory
+  segment, which stays mapped as long as any of them is alive; but
+  the client overwrites it on its next call: inputs must be cloned
+  for their values to be kept around.
+
+  If set, MATTORCH_PRELOAD (comma-separated module names) is required
+  before running the files.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <lua.h>
+#include <luaT.h>
+#include <TH.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "mattorchipc.h"
+
+#define MAXCLIENTS 64
+
+/* a client's input segment, mapped here. Input tensors are built */
+/* directly on it, so it stays mapped as long as the client uses it, */
+/* or any storage built on it is alive: each holds one reference. */
+typedef struct {
+  mtipc_segment seg;
+  int refcount;
+} mapping;
+
+typedef struct {
+  int fd;
+  mapping *in;         /* client's segment: inputs */
+  mtipc_segment out;   /* our segment: outputs */
+} client;
+
+/* state of one call, shared with the protected part of serve() */
+typedef struct {
+  client *c;
+  mtipc_message *msg;
+  void *tensors[MTIPC_MAXARRAYS];   /* contiguous outputs, to free */
+  int ntensors;
+} call;
+
+static const char *typenames[] = {
+  NULL,
+  "torch.DoubleTensor",
+  "torch.FloatTensor",
+  "torch.LongTensor",
+  "torch.IntTensor",
+  "torch.ShortTensor",
+  "torch.CharTensor",
+  "torch.ByteTensor"
+};
+
+static int traceback (lua_State *L) {
+  if (!lua_isstring(L, 1))  /* 'message' not a string? */
+    return 1;  /* keep it intact */
+  lua_getfield(L, LUA_GLOBALSINDEX, "debug");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_getfield(L, -1, "traceback");
+  if (!lua_isfunction(L, -1)) {
+    lua_pop(L, 2);
+    return 1;
+  }
+  lua_pushvalue(L, 1);  /* pass error message */
+  lua_pushinteger(L, 2);  /* skip this function and traceback */
+  lua_call(L, 2, 1);  /* call debug.traceback */
+  return 1;
+}
+
+static int docall (lua_State *L, int narg, int nres) {
+  int status;
+  int base = lua_gettop(L) - narg;  /* function index */
+  lua_pushcfunction(L, traceback);  /* push traceback function */
+  lua_insert(L, base);  /* put it under chunk and args */
+  status = lua_pcall(L, narg, nres, base);
+  lua_remove(L, base);  /* remove traceback function */
+  /* force a complete garbage collection in case of errors */
+  if (status != 0) lua_gc(L, LUA_GCCOLLECT, 0);
+  return status;
+}
+
+/* ------------------------------------------------------------ */
+/* mappings, and the allocator of storages built on them */
+
+static void releasemapping (mapping *m) {
+  if (m && --m->refcount == 0) {
+    mtipc_segment_release(&m->seg);
+    free(m);
+  }
+}
+
+/* each input storage holds one reference to its mapping, until */
+/* it is freed, or resized (its data then moves to the heap) */
+typedef struct {
+  mapping *m;
+} mappingref;
+
+static void *mappingmalloc (void *ctx, long size) {
+  (void)ctx;
+  return THAlloc(size);
+}
+
+static void *mappingrealloc (void *ctx, void *ptr, long size) {
+  mappingref *ref = (mappingref *)ctx;
+  if (ref->m == NULL) return THRealloc(ptr, size);
+  void *data = THAlloc(size);
+  if (ptr) {
+    long avail = (char *)ref->m->seg.data + ref->m->seg.size - (char *)ptr;
+    memcpy(data, ptr, size < avail ? size : avail);
+  }
+  releasemapping(ref->m);
+  ref->m = NULL;
+  return data;
+}
+
+static void mappingfree (void *ctx, void *ptr) {
+  mappingref *ref = (mappingref *)ctx;
+  if (ref->m) releasemapping(ref->m);
+  else THFree(ptr);
+  free(ref);
+}
+
+static THAllocator mappingallocator = {
+  mappingmalloc, mappingrealloc, mappingfree
+};
+
+/* push a tensor over array data, without copying it */
+#define PUSH_TENSOR(TYPE, Real, real)                                         \
+    case TYPE: {                                                              \
+      TH##Real##Storage *storage = TH##Real##Storage_newWithDataAndAllocator( \
+        (real *)data, n, &mappingallocator, ref);                            \
+      TH##Real##Tensor *tensor = TH##Real##Tensor_newWithStorage(storage, 0, size, NULL); \
+      TH##Real##Storage_free(storage);                                        \
+      luaT_pushudata(L, tensor, id);                                          \
+      break;                                                                  \
+    }
+
+static int pushinput (lua_State *L, const mtipc_array *a, mapping *m) {
+  size_t elemsize = mtipc_typesize(a->type);
+  int k;
+  if (elemsize == 0 || a->ndims < 0 || a->ndims > MTIPC_MAXDIMS
+      || a->offset < 0 || a->nbytes < 0 || a->offset > m->seg.size
+      || a->nbytes > m->seg.size - a->offset)
+    return -1;
+  long n = a->nbytes / elemsize, nelem = 1;
+  for (k=0; k<a->ndims; k++) {
+    if (a->dims[k] < 0) return -1;
+    nelem *= a->dims[k];
+  }
+  if (nelem != n) return -1;
+
+  /* may raise an error: before anything is allocated */
+  const void *id = luaT_checktypename2id(L, typenames[a->type]);
+  mappingref *ref = (mappingref *)malloc(sizeof(mappingref));
+  if (ref == NULL) return -1;
+  ref->m = m;
+  m->refcount++;
+  void *data = (char *)m->seg.data + a->offset;
+  THLongStorage *size = THLongStorage_newWithSize(a->ndims);
+  for (k=0; k<a->ndims; k++) THLongStorage_set(size, k, a->dims[k]);
+
+  switch (a->type) {
+    PUSH_TENSOR(MTIPC_DOUBLE, Double, double)
+    PUSH_TENSOR(MTIPC_FLOAT, Float, float)
+    PUSH_TENSOR(MTIPC_LONG, Long, long)
+    PUSH_TENSOR(MTIPC_INT, Int, int)
+    PUSH_TENSOR(MTIPC_SHORT, Short, short)
+    PUSH_TENSOR(MTIPC_CHAR, Char, char)
+    PUSH_TENSOR(MTIPC_BYTE, Byte, unsigned char)
+  }
+
+  THLongStorage_free(size);
+  return 0;
+}
+
+/* contiguous copy of an output tensor, described in a */
+#define GET_OUTPUT(TYPE, Real)                                                \
+    if (tensor == NULL && luaT_isudata(L, idx, luaT_checktypename2id(L, typenames[TYPE]))) { \
+      TH##Real##Tensor *t = TH##Real##Tensor_newContiguous(                   \
+        (TH##Real##Tensor *)luaT_toudata(L, idx, luaT_checktypename2id(L, typenames[TYPE]))); \
+      tensor = t;                                                             \
+      *data = TH##Real##Tensor_data(t);                                       \
+      a->type = TYPE;                                                         \
+      a->ndims = t->nDimension;                                               \
+      for (k=0; k<t->nDimension && k<MTIPC_MAXDIMS; k++) a->dims[k] = t->size[k]; \
+      a->nbytes = TH##Real##Tensor_nElement(t) * sizeof(*TH##Real##Tensor_data(t)); \
+    }
+
+static void *getoutput (lua_State *L, int idx, mtipc_array *a, void **data) {
+  void *tensor = NULL;
+  int k;
+  GET_OUTPUT(MTIPC_DOUBLE, Double)
+  GET_OUTPUT(MTIPC_FLOAT, Float)
+  GET_OUTPUT(MTIPC_LONG, Long)
+  GET_OUTPUT(MTIPC_INT, Int)
+  GET_OUTPUT(MTIPC_SHORT, Short)
+  GET_OUTPUT(MTIPC_CHAR, Char)
+  GET_OUTPUT(MTIPC_BYTE, Byte)
+  return tensor;
+}
+
+static void freeoutput (void *tensor, int type) {
+  switch (type) {
+    case MTIPC_DOUBLE: THDoubleTensor_free(tensor); break;
+    case MTIPC_FLOAT: THFloatTensor_free(tensor); break;
+    case MTIPC_LONG: THLongTensor_free(tensor); break;
+    case MTIPC_INT: THIntTensor_free(tensor); break;
+    case MTIPC_SHORT: THShortTensor_free(tensor); break;
+    case MTIPC_CHAR: THCharTensor_free(tensor); break;
+    case MTIPC_BYTE: THByteTensor_free(tensor); break;
+  }
+}
+
+/* the Lua/TH part of a call, run under lua_cpcall(): any error */
+/* (torch not loaded, out of memory, ...) fails the call instead */
+/* of bringing the server down */
+static int servecall (lua_State *L) {
+  call *cl = (call *)lua_touserdata(L, 1);
+  mtipc_message *msg = cl->msg;
+  client *c = cl->c;
+  int ninputs = msg->narrays, noutputs = msg->noutputs;
+  int i, o;
+
+  // (1) push function and arguments
+  lua_getfield(L, LUA_GLOBALSINDEX, msg->func);
+  if (!lua_isfunction(L, -1))
+    return luaL_error(L, "no such global function: %s", msg->func);
+  for (i=0; i<ninputs; i++) {
+    if (pushinput(L, &msg->arrays[i], c->in) != 0)
+      return luaL_error(L, "invalid input array %d", i+1);
+  }
+
+  // (2) call
+  if (docall(L, ninputs, noutputs) != 0)
+    return lua_error(L);
+
+  // (3) outputs: contiguous tensors, copied into our segment
+  void *data[MTIPC_MAXARRAYS];
+  int64_t total = 0;
+  for (o=0; o<noutputs; o++) {
+    mtipc_array *a = &msg->arrays[o];
+    memset(a, 0, sizeof(*a));
+    void *tensor = getoutput(L, -noutputs+o, a, &data[o]);
+    if (tensor == NULL)
+      return luaL_error(L, "unsupported output type (output %d)", o+1);
+    cl->tensors[cl->ntensors++] = tensor;
+    if (a->ndims > MTIPC_MAXDIMS)
+      return luaL_error(L, "too many dimensions in output %d", o+1);
+    a->offset = total;
+    total += mtipc_align(a->nbytes);
+  }
+  if (mtipc_segment_reserve(&c->out, total) != 0)
+    return luaL_error(L, "could not create output segment");
+  for (o=0; o<noutputs; o++)
+    memcpy((char *)c->out.data + msg->arrays[o].offset, data[o], msg->arrays[o].nbytes);
+  msg->narrays = noutputs;
+  memcpy(msg->shm, c->out.name, MTIPC_NAMELEN);
+  msg->shmsize = c->out.size;
+  return 0;
+}
+
+static void fail (mtipc_message *msg, const char *error) {
+  msg->status = 1;
+  msg->narrays = 0;
+  strncpy(msg->error, error, sizeof(msg->error)-1);
+  msg->error[sizeof(msg->error)-1] = '\0';
+}
+
+/* map (or keep) the client's input segment */
+static int mapinputs (client *c, const char *name, int64_t size) {
+  if (c->in && c->in->seg.size == size && strncmp(c->in->seg.name, name, MTIPC_NAMELEN) == 0)
+    return 0;
+  releasemapping(c->in);
+  c->in = (mapping *)calloc(1, sizeof(mapping));
+  if (c->in == NULL) return -1;
+  c->in->refcount = 1;
+  if (mtipc_segment_map(&c->in->seg, name, size) != 0) {
+    releasemapping(c->in);
+    c->in = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* serve one call: returns 0 if the reply could be sent */
+static int serve (lua_State *L, client *c) {
+  mtipc_message msg;
+  if (mtipc_recv(c->fd, &msg) != 0) return -1;
+  int top = lua_gettop(L);
+  int i;
+  msg.func[sizeof(msg.func)-1] = '\0';
+  msg.shm[sizeof(msg.shm)-1] = '\0';
+  msg.status = 0;
+  msg.error[0] = '\0';
+
+  // (1) map inputs
+  if (msg.narrays < 0 || msg.narrays > MTIPC_MAXARRAYS
+      || msg.noutputs < 0 || msg.noutputs > MTIPC_MAXARRAYS) {
+    fail(&msg, "too many inputs or outputs");
+    return mtipc_send(c->fd, &msg);
+  }
+  if (mapinputs(c, msg.shm, msg.shmsize) != 0) {
+    fail(&msg, "could not map input segment");
+    return mtipc_send(c->fd, &msg);
+  }
+
+  // (2) call, protected
+  call cl;
+  memset(&cl, 0, sizeof(cl));
+  cl.c = c;
+  cl.msg = &msg;
+  if (lua_cpcall(L, servecall, &cl) != 0) {
+    const char *error = lua_tostring(L, -1);
+    fail(&msg, error ? error : "(error object is not a string)");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  }
+  for (i=0; i<cl.ntensors; i++)
+    freeoutput(cl.tensors[i], msg.arrays[i].type);
+  lua_settop(L, top);
+
+  return mtipc_send(c->fd, &msg);
+}
+
+static void dropclient (client *c) {
+  close(c->fd);
+  c->fd = -1;
+  releasemapping(c->in);
+  c->in = NULL;
+  mtipc_segment_release(&c->out);
+}
+
+int main (int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <socket> <file.lua> [<file.lua> ...]\n", argv[0]);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Lua state, preloaded modules and user files */
+  lua_State *L = lua_open();
+  lua_gc(L, LUA_GCSTOP, 0);
+  luaL_openlibs(L);
+  lua_gc(L, LUA_GCRESTART, 0);
+
+  const char *modules = getenv("MATTORCH_PRELOAD");
+  if (modules && *modules) {
+    char *list = strdup(modules);
+    char *name, *save = NULL;
+    for (name = strtok_r(list, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+      lua_getglobal(L, "require");
+      lua_pushstring(L, name);
+      if (docall(L, 1, 0) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], lua_tostring(L, -1));
+        return 1;
+      }
+    }
+    free(list);
+  }
+  int i;
+  for (i=2; i<argc; i++) {
+    if (luaL_loadfile(L, argv[i]) || docall(L, 0, 0)) {
+      fprintf(stderr, "%s: %s\n", argv[0], lua_tostring(L, -1));
+      return 1;
+    }
+  }
+
+  /* serve */
+  int server = mtipc_listen(argv[1]);
+  if (server < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  fprintf(stderr, "%s: listening on %s\n", argv[0], argv[1]);
+
+  client clients[MAXCLIENTS];
+  struct pollfd fds[MAXCLIENTS+1];
+  memset(clients, 0, sizeof(clients));
+  for (i=0; i<MAXCLIENTS; i++) clients[i].fd = -1;
+
+  while (1) {
+    fds[0].fd = server;
+    fds[0].events = POLLIN;
+    for (i=0; i<MAXCLIENTS; i++) {
+      fds[i+1].fd = clients[i].fd;
+      fds[i+1].events = POLLIN;
+      fds[i+1].revents = 0;
+    }
+    if (poll(fds, MAXCLIENTS+1, -1) < 0) continue;
+
+    /* new client */
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(server, NULL, NULL);
+      for (i=0; fd >= 0 && i<MAXCLIENTS; i++) {
+        if (clients[i].fd < 0) {
+          clients[i].fd = fd;
+          fd = -1;
+        }
+      }
+      if (fd >= 0) close(fd);  /* too many clients */
+    }
+
+    /* calls */
+    for (i=0; i<MAXCLIENTS; i++) {
+      if (clients[i].fd >= 0 && (fds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+        if (serve(L, &clients[i]) != 0) dropclient(&clients[i]);
+      }
+    }
+  }
+
+  lua_close(L);
+  return 0;
+}